@@ -0,0 +1,97 @@
+#pragma once
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <span>
+#include <string_view>
+
+struct Machine;
+
+enum class AccelMode {
+  // Run every routine as guest code
+  Off,
+  // Replace recognised routines with their native implementations
+  Native,
+  // Run the guest code and the native implementation side by side, keeping
+  // the guest's result and reporting any difference
+  Verify,
+};
+
+// A native stand-in for a guest routine, called with the CPU at the
+// routine's entry point. It must leave registers, flags and memory exactly as
+// the guest code would just before its final RET (which the emulator then
+// executes), and charge the T-states and R increments of everything else.
+// Returning false declines the call without changing anything, and the guest
+// code runs instead.
+using NativeRoutine = bool (*)(Machine &machine);
+
+struct KnownRoutine {
+  const char *name;
+  // Fingerprint of the routine's first `length` code bytes; see fingerprint()
+  uint16_t length;
+  uint64_t hash;
+  NativeRoutine native;
+};
+
+// FNV-1a over a routine's code bytes. Registry entries are keyed by this
+// rather than the bytes themselves, so fingerprints of proprietary runtimes
+// can be listed without including their code.
+constexpr uint64_t fingerprint(std::span<const uint8_t> code) {
+  uint64_t hash = 0xcbf29ce484222325;
+  for (uint8_t byte : code) {
+    hash = (hash ^ byte) * 0x100000001b3;
+  }
+  return hash;
+}
+
+// Every routine the accelerator knows how to replace
+std::span<const KnownRoutine> known_routines();
+
+// Finds known routines in loaded programs and traps their entry points so
+// calls go to the native implementations instead. The pages holding them are
+// write protected, and a routine the program overwrites (patching an operand,
+// loading an overlay) goes back to running as guest code.
+class Accelerator {
+public:
+  explicit Accelerator(Machine &machine);
+
+  AccelMode get_mode() const { return mode; }
+  void set_mode(AccelMode mode) { this->mode = mode; }
+
+  // Remove the traps set for the previous program. Called before a new image
+  // is loaded over it.
+  void clear();
+  // Trap every known routine found in [begin, end)
+  void scan(uint16_t begin, uint16_t end);
+
+  // Whether any routine was found in the current program
+  bool empty() const { return sites.empty(); }
+  // Calls per routine, for --stats
+  void report(std::ostream &out) const;
+
+private:
+  struct Site {
+    const KnownRoutine *routine;
+    uint64_t calls = 0;
+    // Set when verification found a difference or the code was changed;
+    // the guest code runs from then on
+    bool disabled = false;
+    bool changed = false;
+  };
+
+  uint8_t enter(uint16_t address);
+  // Called for writes to pages holding routines
+  void written(uint16_t address);
+  bool verify(uint16_t address, Site &site);
+
+  Machine &machine;
+  AccelMode mode = AccelMode::Native;
+  std::map<uint16_t, Site> sites;
+  // Routines by code length, then fingerprint
+  std::map<uint16_t, std::map<uint64_t, const KnownRoutine *>> index;
+  uint16_t longest = 0;
+  // Scratch memory for verification, allocated on first use
+  std::unique_ptr<uint8_t[]> saved_memory;
+  std::unique_ptr<uint8_t[]> guest_memory;
+};
@@ -1,5 +1,22 @@
 #pragma once
 #include <cstdint>
+// <unistd.h> defines F_LOCK (for lockf()) and L_SET (an old name for
+// SEEK_SET), which clash with the BDOS functions of the same names. Include it
+// first so the macros can be removed for good.
+#include <unistd.h>
+#undef F_LOCK
+#undef L_SET
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <file_cache.hpp>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 
 enum CpmError {
   // 0 - Software error (e.g. file not found)
@@ -363,3 +380,110 @@ struct FileControlBlock {
   // 18‑bit)
   uint8_t r[3];
 };
+
+// Parse a CP/M file specification ("B:NAME.TYP", '*' wildcards allowed) into
+// the drive, name and type fields of an FCB. Unused name/type characters are
+// space filled and '*' expands to '?'. Returns false if the text is not a
+// valid file specification.
+bool parse_filename(std::string_view text, FileControlBlock &fcb);
+
+// Host files in the current directory whose names fit CP/M 8.3 and match the
+// name and type of `pattern` ('?' matches any character), sorted by name
+std::vector<std::string> find_files(const FileControlBlock &pattern);
+
+struct Machine;
+
+struct OpenFile {
+  std::fstream stream;
+  // Shared copy of the file, used for reads until the file is written
+  std::shared_ptr<const CachedFile> cache;
+  // The host file, for invalidating other handles' copies when writing
+  FileId id{};
+  // Whether the next read may make `cache`; cleared once it has been tried
+  // and when the file is written
+  bool cacheable = true;
+  // FileCache::generation() when `cache` was last known to be current
+  uint64_t cache_generation = 0;
+  // When the host file was last compared with `cache`
+  std::chrono::steady_clock::time_point cache_checked;
+};
+
+enum class BdosProfile {
+  // CP/M 2.2: functions 0-37 and 40
+  Cpm22,
+  // CP/M Plus (3.x): adds 38-50, 59-60, 98-112 and 152
+  Cpm3,
+  // MP/M II: CP/M 2.2 plus record locking, 98-107 and the process, queue and
+  // device functions from 128 up
+  Mpm,
+};
+
+class Bdos;
+class Scheduler;
+
+// A BDOS function: receives DE and returns HL (A = L, B = H)
+using BdosFunction = uint16_t (*)(Bdos &bdos, uint16_t arg);
+using BdosTable = std::array<BdosFunction, 256>;
+
+// Guest memory the BDOS keeps its data structures in. 0006h points here, so
+// programs see the TPA end just below it.
+constexpr uint16_t BDOS_BASE = 0xfe00;
+// Disk parameter block for drive A:
+constexpr uint16_t BDOS_DPB = BDOS_BASE + 0x10;
+// MP/M system data page and process descriptor stand-ins
+constexpr uint16_t BDOS_SYSDAT = BDOS_BASE + 0x40;
+constexpr uint16_t BDOS_PD = BDOS_BASE + 0x80;
+// Allocation vector for drive A:
+constexpr uint16_t BDOS_ALV = BDOS_BASE + 0x100;
+
+// MP/M system tick, the unit of P_DELAY
+constexpr unsigned MPM_TICKS_PER_SECOND = 60;
+
+// The BDOS. Function calls are dispatched through a table built at compile
+// time for each profile, so a call is a single indirect jump and functions
+// can be added or swapped without touching the CPU loop.
+class Bdos {
+public:
+  explicit Bdos(Machine &machine, BdosProfile profile = BdosProfile::Cpm22);
+
+  BdosProfile get_profile() const { return profile; }
+  void set_profile(BdosProfile profile);
+  // Install or replace a single function on top of the profile's table
+  void set_function(uint8_t func, BdosFunction handler) {
+    table[func] = handler;
+  }
+  BdosFunction get_function(uint8_t func) const { return table[func]; }
+
+  uint16_t call(uint8_t func, uint16_t arg) { return table[func](*this, arg); }
+
+  // Warm boot: close files, reset the DMA address and rebuild the BDOS area
+  void reset();
+
+  Machine &machine;
+  uint16_t dma_address = 0x80;
+  std::unordered_map<std::string, OpenFile> open_files;
+  // Terminator for C_WRITESTR (C_DELIMIT)
+  char delimiter = '$';
+  // Records transferred per read/write call (F_MULTISEC)
+  uint8_t multisector_count = 1;
+  uint8_t error_mode = 0;
+  uint16_t console_mode = 0;
+  // Passed between programs (P_CODE), so kept over warm boots
+  uint16_t return_code = 0;
+  uint16_t readonly_vector = 0;
+  // Seconds T_SET moved the clock away from the host's
+  int64_t clock_offset = 0;
+  // Remaining matches for F_SNEXT
+  std::vector<std::string> search_results;
+  size_t search_next = 0;
+  // Command line left by P_CHAIN for the CCP to run next
+  std::string chain_command;
+  // CP/M 3 System Control Block, as seen through S_SCB
+  std::array<uint8_t, 0x64> scb{};
+  // Set when this BDOS is one process of an MP/M system
+  Scheduler *scheduler = nullptr;
+
+private:
+  BdosProfile profile;
+  BdosTable table;
+};
@@ -0,0 +1,41 @@
+#pragma once
+#include <bdos.hpp>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct Machine;
+
+// Console Command Processor: runs command lines against a single Machine,
+// warm booting it between programs.
+class Ccp {
+public:
+  explicit Ccp(Machine &machine);
+
+  // Execute a command line. Several commands may be chained with '!'.
+  // Returns false if a command could not be found or run.
+  bool execute(std::string_view line);
+
+  // Prepare a single command: built-ins are executed immediately, programs
+  // are loaded and their zero page filled in. Returns true if a program is
+  // loaded and ready for Machine::run().
+  bool prepare(std::string_view command, bool &ok);
+
+  // Run every line of a .SUB file, substituting $1..$9 with `args`
+  bool submit(const std::filesystem::path &path,
+              const std::vector<std::string> &args);
+
+  // Prompt for commands on the console until end of input
+  void interactive();
+
+private:
+  Machine &machine;
+
+  void setup_zero_page(std::string_view tail);
+
+  bool dir(std::string_view args);
+  bool era(std::string_view args);
+  bool ren(std::string_view args);
+  bool type(std::string_view args);
+};
@@ -0,0 +1,15 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+// Returns true if a character can be read from the console without blocking.
+bool console_has_char();
+
+// Reads one character from the console without echo, blocking until one is
+// typed. Returns -1 at end of file.
+int read_console_char();
+
+// Reads a line from the console with echo and simple BS/DEL editing, stopping
+// at CR/LF or after `max` characters. The terminator is not stored. Returns
+// false if the console reached end of file before anything was typed.
+bool read_console_line(std::string &line, size_t max);
@@ -0,0 +1,40 @@
+#pragma once
+#include <cstdint>
+
+struct Machine;
+
+enum class DelayLoopMode {
+  // Execute delay loops instruction by instruction
+  Faithful,
+  // Skip to the last iteration of recognised delay loops, charging the
+  // T-states the skipped iterations would have taken
+  FastForward,
+};
+
+// Opcodes that may begin a loop recognised by fast_forward_delay_loop().
+// Kept inline so the common case in fetch_opcode is a single table test.
+inline bool may_start_delay_loop(uint8_t opcode) {
+  switch (opcode) {
+  case 0x10: // DJNZ
+  case 0x05: // DEC B
+  case 0x0d: // DEC C
+  case 0x15: // DEC D
+  case 0x1d: // DEC E
+  case 0x25: // DEC H
+  case 0x2d: // DEC L
+  case 0x3d: // DEC A
+  case 0x0b: // DEC BC
+  case 0x1b: // DEC DE
+  case 0x2b: // DEC HL
+    return true;
+  default:
+    return false;
+  }
+}
+
+// If a side-effect-free counting loop starts at `address`, advance the CPU
+// state to the start of its final iteration, as if the loop had been run
+// until the counter reached 1. The final iteration is then executed normally
+// so that registers and flags come out exactly as on real hardware.
+// Returns true if the loop was fast-forwarded.
+bool fast_forward_delay_loop(Machine &machine, uint16_t address);
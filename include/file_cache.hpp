@@ -0,0 +1,97 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <sys/types.h>
+#include <utility>
+#include <vector>
+
+// A host file identified by device and inode
+using FileId = std::pair<dev_t, ino_t>;
+
+// Identity of the file at `path`, or {0, 0} if there is none
+FileId file_id(const std::filesystem::path &path);
+
+// A private, read-only copy of a host file's contents. Unlike a shared
+// mapping, it cannot change size or fault under a reader when the file is
+// truncated or rewritten.
+class CachedFile {
+public:
+  CachedFile(FileId id, std::vector<uint8_t> contents, timespec mtime);
+
+  CachedFile(const CachedFile &) = delete;
+  CachedFile &operator=(const CachedFile &) = delete;
+
+  const uint8_t *data() const { return bytes.data(); }
+  size_t size() const { return bytes.size(); }
+  FileId id() const { return file; }
+  const timespec &modified() const { return mtime; }
+
+private:
+  FileId file;
+  std::vector<uint8_t> bytes;
+  timespec mtime;
+};
+
+// Process-wide cache of data file contents. Every Machine and every open
+// handle on the same host file shares one copy, so hot read-only files
+// (story files, databases) are read once instead of through a read() per
+// record. A copy lives only as long as some handle is reading from it.
+class FileCache {
+public:
+  struct Stats {
+    // Opens served by an existing copy
+    uint64_t hits = 0;
+    // Opens that had to read the file
+    uint64_t misses = 0;
+    // Copies dropped because the file changed
+    uint64_t invalidations = 0;
+    // 128-byte records copied out of the cache
+    uint64_t records = 0;
+  };
+
+  static FileCache &instance();
+
+  // Shared copy of `path`, or nullptr if it cannot be cached (e.g. empty)
+  std::shared_ptr<const CachedFile> open(const std::filesystem::path &path);
+  // Forget any copy of `path`; call whenever the file is modified
+  void invalidate(const std::filesystem::path &path);
+  // As above, without looking the file up on the host. Cheap enough to call
+  // for every record written.
+  void invalidate(FileId id);
+
+  // Bumped by every invalidation. A handle holding a copy compares this with
+  // the generation it last checked at before reading from it, so the check
+  // costs nothing until some file has changed.
+  uint64_t generation() const { return current_generation; }
+  // Whether `file` is still the cached copy of its host file
+  bool current(const CachedFile &file) const;
+  // Whether the file at `path` is no longer the one `file` was read from,
+  // e.g. because it was rewritten by a host program
+  static bool changed_on_host(const CachedFile &file,
+                              const std::filesystem::path &path);
+
+  // Called for every record read; left unlocked since emulation runs on a
+  // single host thread
+  void count_record() { records++; }
+  Stats stats() const;
+  void report(std::ostream &out) const;
+
+private:
+  // Drop the copy of `id`; the caller holds `mutex`
+  void drop(FileId id);
+
+  mutable std::mutex mutex;
+  // Entries whose copy has expired are swept out by open()
+  std::map<FileId, std::weak_ptr<const CachedFile>> files;
+  Stats counters;
+  uint64_t records = 0;
+  uint64_t current_generation = 0;
+
+  FileCache() = default;
+};
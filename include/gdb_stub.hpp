@@ -0,0 +1,77 @@
+#pragma once
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct Machine;
+
+// gdb remote serial protocol server for the guest Z80.
+//
+// Breakpoints are trap opcodes patched into guest memory and watchpoints are
+// page-level write protection, so a Machine with no debugger attached runs
+// exactly the same code as one built without this stub.
+class GdbStub {
+public:
+  explicit GdbStub(Machine &machine);
+  ~GdbStub();
+
+  GdbStub(const GdbStub &) = delete;
+  GdbStub &operator=(const GdbStub &) = delete;
+
+  // Listen on a TCP port ("1234" or "localhost:1234", bound to the loopback
+  // interface only) or a Unix socket path, and wait for gdb to connect.
+  bool listen(std::string_view address);
+
+  // Called by Machine::run() before the first instruction of a program
+  void program_started();
+  // Called by Machine::run() between slices
+  void slice_finished();
+
+private:
+  struct Watchpoint {
+    uint16_t address;
+    uint16_t length;
+  };
+
+  Machine &machine;
+  int connection = -1;
+  std::string unix_path;
+  std::vector<uint8_t> input;
+  bool started = false;
+  // gdb is waiting for a stop reply
+  bool resumed = false;
+  // A single step was requested while stopped inside a trap
+  bool step_pending = false;
+  // The next breakpoint hit at this address is the instruction gdb resumed
+  // from, not a new hit
+  std::optional<uint16_t> skip_breakpoint;
+  std::optional<uint16_t> watch_hit;
+  std::vector<uint16_t> breakpoints;
+  std::vector<Watchpoint> watchpoints;
+
+  enum class Resume { Continue, Step, Kill };
+
+  int read_byte(bool block);
+  bool interrupt_requested();
+  std::optional<std::string> receive_packet();
+  void send_packet(std::string_view data);
+
+  // Report a stop and serve requests until gdb resumes the target
+  Resume serve(std::string_view stop_reply);
+  // Stop at an instruction boundary, single stepping here as gdb asks
+  void stop_between_instructions(std::string stop_reply);
+  std::optional<std::string> handle(std::string_view packet);
+
+  uint8_t breakpoint_hit(uint16_t address);
+  void protected_write(uint16_t address);
+  void update_write_protect();
+
+  bool insert_breakpoint(uint16_t address);
+  void remove_breakpoint(uint16_t address);
+  void detach();
+
+  std::string read_registers() const;
+  void write_register(unsigned index, uint16_t value);
+};
@@ -0,0 +1,45 @@
+#pragma once
+#include <Z80.h>
+#include <cstdint>
+#include <ctime>
+#include <ostream>
+
+// Paces emulation to a target clock speed. The CPU is run in short slices and
+// the host sleeps until wall time catches up with the emulated T-states, so a
+// throttled session leaves the host core idle instead of spinning.
+class ClockGovernor {
+public:
+  // 0 Hz runs unthrottled
+  explicit ClockGovernor(uint64_t hz = 0);
+
+  uint64_t hz() const { return clock_hz; }
+
+  // T-states to execute before the next call to pace()
+  zusize slice() const { return slice_cycles; }
+
+  // Sleep until the wall clock reaches the time at which `cycles` T-states
+  // would have completed on the emulated CPU
+  void pace(uint64_t cycles);
+
+private:
+  uint64_t clock_hz;
+  zusize slice_cycles;
+  // Wall time and cycle count the current schedule is measured from
+  timespec epoch{};
+  uint64_t epoch_cycles = 0;
+  bool started = false;
+
+  void rebase(const timespec &now, uint64_t cycles);
+};
+
+// Wall time, host CPU time and emulated T-states over a session
+class SessionStats {
+public:
+  SessionStats();
+
+  void report(std::ostream &out, uint64_t cycles, uint64_t hz) const;
+
+private:
+  timespec wall_start;
+  timespec cpu_start;
+};
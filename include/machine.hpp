@@ -1,16 +1,94 @@
 #pragma once
 #include "Z80.h"
+#include <accel.hpp>
+#include <bdos.hpp>
+#include <bitset>
 #include <cstdint>
+#include <delay_loop.hpp>
+#include <filesystem>
+#include <functional>
+#include <governor.hpp>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <terminal.hpp>
+#include <unordered_map>
+#include <vector>
+
+struct Machine;
+class GdbStub;
+
+// Opcode patched over an instruction to divert execution to a host handler.
+// LD H,H does nothing, so real programs have no reason to contain it.
+constexpr uint8_t TRAP_OPCODE = 0x64;
+
+// Called when execution reaches a trap; returns the opcode to execute instead
+using TrapHandler = std::function<uint8_t(Machine &, uint16_t address)>;
+
+struct Trap {
+  // The byte the trap opcode replaced
+  uint8_t original;
+  TrapHandler handler;
+};
+
+// Called after the program (or the BDOS on its behalf) writes to a watched
+// page
+using WriteHandler = std::function<void(Machine &, uint16_t address)>;
+
+struct WriteWatch {
+  // Whoever set the watch (debugger, accelerator), so each can replace its own
+  const void *owner;
+  std::bitset<256> pages;
+  WriteHandler handler;
+};
 
 struct Machine {
   Z80 cpu;
   uint8_t memory[65536];
   bool running = true;
-  uint16_t dma_address = 0x80;
+  DelayLoopMode delay_loops = DelayLoopMode::FastForward;
+  Bdos bdos{*this};
+  // Native stand-ins for known routines of the loaded program
+  Accelerator accel{*this};
+  ClockGovernor governor;
+  Terminal terminal;
+  // T-states executed over the whole session
+  uint64_t cycles = 0;
+  std::unordered_map<uint16_t, Trap> traps;
+  // Pages (256 bytes each) whose writes are reported to some write watch
+  std::bitset<256> write_protected;
+  std::vector<WriteWatch> write_watches;
+  // Attached debugger, if any; checked once per slice by run()
+  GdbStub *debugger = nullptr;
 
   Machine();
 
   void init_cpm_zero_page();
+  // Reset the CPU, zero page and BDOS ready for the next program
+  void warm_boot();
+  // Load a .COM image at 0100h and look for known routines in it
+  bool load_program(const std::filesystem::path &path);
+  void set_command_tail(std::string_view tail);
+  // Execute until the program exits to CP/M
+  void run();
+  // Return to CP/M once the current instruction completes
+  void stop();
+
+  // Patch a trap over the instruction at `address`. Fails if one is there.
+  bool set_trap(uint16_t address, TrapHandler handler);
+  // Remove a trap, restoring the original byte
+  void clear_trap(uint16_t address);
+  // Memory as the program sees it, i.e. with traps undone
+  uint8_t peek(uint16_t address) const;
+  void poke(uint16_t address, uint8_t value);
+  // Report writes to `pages` to `handler`, replacing the watch `owner` set
+  // before. No pages removes it.
+  void set_write_protect(const void *owner, std::bitset<256> pages,
+                         WriteHandler handler);
+  // Pass a write to a protected page on to the watches covering it
+  void protected_write(uint16_t address);
+
   void memin(uint16_t dest, void *src, uint16_t count);
+  // Copy out of memory as the program sees it, like peek()
   void memout(void *dest, uint16_t src, uint16_t count);
 };
@@ -0,0 +1,121 @@
+#pragma once
+#include <bdos.hpp>
+#include <bitset>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <governor.hpp>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct Machine;
+class Ccp;
+
+enum class ProcessState {
+  Ready,
+  // P_DELAY: asleep until wake_time
+  Delayed,
+  // Q_READ on an empty queue or Q_WRITE to a full one
+  WaitQueue,
+  // DEV_WAITFLAG on a clear flag
+  WaitFlag,
+  // C_ATTACH, or console input, while another process has the console
+  WaitConsole,
+  // Console input with nothing typed yet
+  WaitInput,
+  Done,
+};
+
+// One MP/M process: a program with its own 64K memory bank and CPU
+struct Process {
+  // Space padded to 8 characters, as in the process descriptor
+  std::string name;
+  std::unique_ptr<Machine> machine;
+  std::unique_ptr<Ccp> ccp;
+  // 0 is the highest; MP/M starts user programs at 200
+  uint8_t priority = 200;
+  ProcessState state = ProcessState::Ready;
+  std::chrono::steady_clock::time_point wake_time;
+};
+
+// A message queue. Queues live on the host, so processes in different
+// banks can share them by name.
+struct MessageQueue {
+  std::string name;
+  uint16_t message_length;
+  uint16_t capacity;
+  std::deque<std::vector<uint8_t>> messages;
+};
+
+// MP/M II style multitasking: several processes share one emulated CPU,
+// switched round robin every tick (highest priority first) and whenever a
+// process blocks in the BDOS. Blocking calls such as Q_READ suspend the
+// process and repeat the call when it is next dispatched.
+class Scheduler {
+public:
+  explicit Scheduler(uint64_t clock_hz = 0);
+  ~Scheduler();
+
+  // Load `command` as a new process. `configure` applies the session's
+  // options to its machine. Returns false if no program was loaded.
+  bool spawn(std::string_view command,
+             const std::function<void(Machine &)> &configure);
+  // Run until every process has terminated. Returns false if they ended up
+  // waiting on each other.
+  bool run();
+
+  // T-states executed by all processes together
+  uint64_t cycles() const { return total_cycles; }
+  // Native routine calls of each process, for --stats
+  void report(std::ostream &out) const;
+
+  // The process whose BDOS call is being handled
+  Process &current() { return *running; }
+
+  // Suspend the current process in `state`. The BDOS call in progress is
+  // made again when the process is next dispatched.
+  uint16_t wait(Bdos &bdos, ProcessState state);
+  // Suspend the current process until `ticks` system ticks have passed
+  uint16_t delay(Bdos &bdos, uint16_t ticks);
+  // End the current time slice
+  void yield();
+  // Make every process waiting in `state` ready to retry its call
+  void wake(ProcessState state);
+
+  Process *find_process(std::string_view name);
+  void terminate(Process &process);
+
+  // Console 0 is owned by one process at a time (C_ATTACH)
+  bool attach_console(Process &process);
+  void detach_console(Process &process);
+  bool console_owned_by_other(const Process &process) const {
+    return console_owner && console_owner != &process;
+  }
+
+  std::map<uint16_t, MessageQueue> queues;
+  uint16_t next_queue_id = 1;
+  // System flags for DEV_WAITFLAG / DEV_SETFLAG
+  std::bitset<32> flags;
+  // The MP/M profile's own functions, for wrappers to call through
+  BdosTable base_functions{};
+
+private:
+  Process *pick();
+  void finished(Process &process);
+  bool idle();
+
+  std::vector<std::unique_ptr<Process>> processes;
+  Process *running = nullptr;
+  Process *console_owner = nullptr;
+  // Round robin position in `processes`
+  size_t next = 0;
+  ClockGovernor governor;
+  // T-states per time slice: one system tick of the emulated clock
+  uint64_t quantum;
+  uint64_t total_cycles = 0;
+};
@@ -0,0 +1,39 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+enum class TerminalType {
+  // Guest output is passed through untouched
+  Ansi,
+  // Lear Siegler ADM-3A (and Kaypro extensions)
+  Adm3a,
+  // DEC VT52
+  Vt52,
+};
+
+// Console output stream. Guest text is translated from the selected terminal's
+// control codes to ANSI escape sequences on the way out. Escape sequences may
+// be split across writes.
+class Terminal {
+public:
+  explicit Terminal(TerminalType type = TerminalType::Ansi) : type(type) {}
+
+  TerminalType get_type() const { return type; }
+
+  // Queue guest output; nothing reaches the host until flush()
+  void write(std::string_view text);
+  void flush();
+
+private:
+  enum class State { Normal, Escape, Row, Column };
+
+  TerminalType type;
+  State state = State::Normal;
+  uint8_t row = 0;
+  std::string out;
+
+  void control(char ch);
+  void escape(char ch);
+  void move_to(uint8_t row, uint8_t column);
+};
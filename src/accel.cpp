@@ -0,0 +1,334 @@
+#include <Z80.h>
+#include <accel.hpp>
+#include <algorithm>
+#include <bitset>
+#include <cstring>
+#include <format>
+#include <iostream>
+#include <machine.hpp>
+
+// Guest T-states a routine may take under verification before it is given up
+// on as not returning
+static constexpr zusize VERIFY_CYCLE_LIMIT = 100'000'000;
+
+namespace {
+
+// Charge the guest instructions a native routine stood in for
+void charge(Z80 &cpu, uint64_t cycles, unsigned fetches) {
+  cpu.cycles += static_cast<zusize>(cycles);
+  cpu.r += static_cast<uint8_t>(fetches);
+}
+
+// HL = BC * DE (low 16 bits) by shift and add, from the top bit of DE down.
+// The usual integer multiply of compiled and interpreted runtimes.
+//
+//   mul16: LD HL,0 / LD A,16
+//   loop:  ADD HL,HL / EX DE,HL / ADD HL,HL / EX DE,HL / JR NC,skip
+//          ADD HL,BC
+//   skip:  DEC A / JR NZ,loop / RET
+constexpr uint8_t mul16_code[] = {0x21, 0x00, 0x00, 0x3e, 0x10, 0x29,
+                                  0xeb, 0x29, 0xeb, 0x30, 0x01, 0x09,
+                                  0x3d, 0x20, 0xf6, 0xc9};
+
+bool native_mul16(Machine &machine) {
+  Z80 &cpu = machine.cpu;
+  uint16_t hl = 0;
+  uint16_t de = cpu.de.uint16_value;
+  uint16_t bc = cpu.bc.uint16_value;
+  bool carry = false;
+
+  // LD HL,0 / LD A,16
+  uint64_t cycles = 10 + 7;
+  unsigned fetches = 2;
+  for (int i = 0; i < 16; i++) {
+    hl = static_cast<uint16_t>(hl << 1);
+    carry = de & 0x8000;
+    de = static_cast<uint16_t>(de << 1);
+    cycles += 11 + 4 + 11 + 4;
+    fetches += 4;
+    if (carry) {
+      carry = hl + bc > 0xffff;
+      hl = static_cast<uint16_t>(hl + bc);
+      cycles += 7 + 11;
+      fetches += 2;
+    } else {
+      cycles += 12;
+      fetches += 1;
+    }
+    // DEC A, and JR NZ taken on all but the last pass
+    cycles += 4 + (i < 15 ? 12 : 7);
+    fetches += 2;
+  }
+
+  cpu.hl.uint16_value = hl;
+  cpu.de.uint16_value = de;
+  // DEC A to zero sets Z and N and keeps the carry of the last addition
+  cpu.af.uint8_array[1] = 0;
+  cpu.af.uint8_array[0] = static_cast<uint8_t>(0x42 | carry);
+  charge(cpu, cycles, fetches);
+  return true;
+}
+
+// BC = length of the NUL-terminated string at HL, leaving HL at the NUL
+//
+//   strlen: LD BC,0
+//   loop:   LD A,(HL) / OR A / RET Z / INC HL / INC BC / JR loop
+constexpr uint8_t strlen_code[] = {0x01, 0x00, 0x00, 0x7e, 0xb7,
+                                   0xc8, 0x23, 0x03, 0x18, 0xf9};
+
+bool native_strlen(Machine &machine) {
+  Z80 &cpu = machine.cpu;
+  const uint8_t *memory = machine.memory;
+  uint16_t start = cpu.hl.uint16_value;
+
+  // The string may run off the top of memory and on from 0000h
+  const void *nul = std::memchr(memory + start, 0, 0x10000 - start);
+  uint32_t length;
+  if (nul) {
+    length = static_cast<uint32_t>(static_cast<const uint8_t *>(nul) -
+                                   (memory + start));
+  } else if ((nul = std::memchr(memory, 0, start))) {
+    length = static_cast<uint32_t>(0x10000 - start +
+                                   (static_cast<const uint8_t *>(nul) - memory));
+  } else {
+    // No terminator anywhere: the guest code would never return
+    return false;
+  }
+
+  cpu.hl.uint16_value = static_cast<uint16_t>(start + length);
+  cpu.bc.uint16_value = static_cast<uint16_t>(length);
+  // OR A with A = 0 sets Z and P/V
+  cpu.af.uint8_array[1] = 0;
+  cpu.af.uint8_array[0] = 0x44;
+  // LD BC,0, each character, then LD A,(HL) / OR A at the NUL. The exit is
+  // RET Z (11 T-states) where the emulator runs a plain RET (10).
+  charge(cpu, 10 + uint64_t(length) * (7 + 4 + 5 + 6 + 6 + 12) + 7 + 4 + 1,
+         1 + length * 6 + 2);
+  return true;
+}
+
+// Fingerprints of the runtime routines worth replacing. Further entries need
+// only the hash and length of the routine as found in the binary.
+constexpr KnownRoutine registry[] = {
+    {"mul16", sizeof(mul16_code), fingerprint(mul16_code), native_mul16},
+    {"strlen", sizeof(strlen_code), fingerprint(strlen_code),
+     native_strlen},
+};
+
+// Copy of memory the guest code runs in under verification
+struct Sandbox {
+  const Machine &machine;
+  uint8_t *memory;
+};
+
+zuint8 sandbox_fetch_opcode(void *context, zuint16 address) {
+  Sandbox &sandbox = *static_cast<Sandbox *>(context);
+  uint8_t opcode = sandbox.memory[address];
+  if (opcode == TRAP_OPCODE) {
+    // Run trapped instructions (this routine's included) as the guest would
+    return sandbox.machine.peek(address);
+  }
+  return opcode;
+}
+
+zuint8 sandbox_read(void *context, zuint16 address) {
+  Sandbox &sandbox = *static_cast<Sandbox *>(context);
+  uint8_t value = sandbox.memory[address];
+  if (value == TRAP_OPCODE) {
+    // Trapped bytes read as the code they replaced, as on the machine itself
+    return sandbox.machine.peek(address);
+  }
+  return value;
+}
+
+void sandbox_write(void *context, zuint16 address, zuint8 value) {
+  static_cast<Sandbox *>(context)->memory[address] = value;
+}
+
+} // namespace
+
+std::span<const KnownRoutine> known_routines() { return registry; }
+
+Accelerator::Accelerator(Machine &machine) : machine(machine) {
+  for (const KnownRoutine &routine : known_routines()) {
+    index[routine.length][routine.hash] = &routine;
+    longest = std::max(longest, routine.length);
+  }
+}
+
+void Accelerator::clear() {
+  for (const auto &[address, site] : sites) {
+    machine.clear_trap(address);
+  }
+  sites.clear();
+  machine.set_write_protect(this, {}, nullptr);
+}
+
+void Accelerator::scan(uint16_t begin, uint16_t end) {
+  clear();
+  if (mode == AccelMode::Off) {
+    return;
+  }
+
+  for (const auto &[length, routines] : index) {
+    for (uint32_t address = begin; address + length <= end; address++) {
+      uint64_t hash = fingerprint({&machine.memory[address], length});
+      auto it = routines.find(hash);
+      if (it == routines.end()) {
+        continue;
+      }
+      uint16_t entry = static_cast<uint16_t>(address);
+      // A breakpoint already set here wins over the native routine
+      if (machine.set_trap(entry, [this](Machine &, uint16_t address) {
+            return enter(address);
+          })) {
+        sites[entry] = {it->second};
+      }
+    }
+  }
+
+  std::bitset<256> pages;
+  for (const auto &[address, site] : sites) {
+    for (uint32_t i = 0; i < site.routine->length; i++) {
+      pages[static_cast<uint16_t>(address + i) >> 8] = true;
+    }
+  }
+  machine.set_write_protect(this, pages, [this](Machine &, uint16_t address) {
+    written(address);
+  });
+}
+
+uint8_t Accelerator::enter(uint16_t address) {
+  Site &site = sites.at(address);
+  bool handled = false;
+  if (!site.disabled) {
+    handled = mode == AccelMode::Verify ? verify(address, site)
+                                        : site.routine->native(machine);
+  }
+  if (!handled) {
+    return machine.peek(address);
+  }
+  site.calls++;
+  return 0xC9; // RET
+}
+
+void Accelerator::written(uint16_t address) {
+  // Every site whose code covers `address`
+  for (auto it = sites.upper_bound(address); it != sites.begin();) {
+    --it;
+    auto &[entry, site] = *it;
+    uint32_t offset = static_cast<uint16_t>(address - entry);
+    if (offset >= longest) {
+      break;
+    }
+    if (offset < site.routine->length && !site.changed) {
+      // Patched or overlaid: no longer the routine the native code stands
+      // in for. Writes happen outside trap handlers, so the trap can go.
+      machine.clear_trap(entry);
+      site.disabled = true;
+      site.changed = true;
+    }
+  }
+}
+
+bool Accelerator::verify(uint16_t address, Site &site) {
+  Z80 &cpu = machine.cpu;
+  if (!saved_memory) {
+    saved_memory = std::make_unique<uint8_t[]>(sizeof(machine.memory));
+    guest_memory = std::make_unique<uint8_t[]>(sizeof(machine.memory));
+  }
+  std::memcpy(saved_memory.get(), machine.memory, sizeof(machine.memory));
+  std::memcpy(guest_memory.get(), machine.memory, sizeof(machine.memory));
+  const Z80 saved = cpu;
+
+  auto disable = [&](std::string_view reason) {
+    std::cerr << std::format("Native {} at {:04X}h disabled: {}\n",
+                             site.routine->name, address, reason);
+    site.disabled = true;
+    std::memcpy(machine.memory, saved_memory.get(), sizeof(machine.memory));
+    cpu = saved;
+    return false;
+  };
+
+  // Guest code first, on a copy of memory, up to the RET that leaves it
+  uint16_t sp = cpu.sp.uint16_value;
+  uint16_t return_sp = static_cast<uint16_t>(sp + 2);
+  uint16_t return_pc = static_cast<uint16_t>(
+      machine.memory[sp] | machine.memory[uint16_t(sp + 1)] << 8);
+  Sandbox sandbox{machine, guest_memory.get()};
+  Z80 guest = cpu;
+  guest.context = &sandbox;
+  guest.fetch_opcode = sandbox_fetch_opcode;
+  guest.fetch = sandbox_read;
+  guest.read = sandbox_read;
+  guest.write = sandbox_write;
+  // The trapped opcode fetch has already counted towards R
+  guest.r--;
+  zusize guest_cycles = 0;
+  while (guest.pc.uint16_value != return_pc ||
+         guest.sp.uint16_value != return_sp) {
+    if (guest_cycles > VERIFY_CYCLE_LIMIT) {
+      return disable("the guest code did not return");
+    }
+    guest_cycles += z80_execute(&guest, 1);
+  }
+
+  // Then the native routine, on the machine itself
+  if (!site.routine->native(machine)) {
+    return false;
+  }
+  // Finish with the RET the emulator will execute
+  Z80 native = cpu;
+  native.pc.uint16_value = return_pc;
+  native.sp.uint16_value = return_sp;
+  native.memptr.uint16_value = return_pc;
+  zusize native_cycles = cpu.cycles - saved.cycles + 10;
+
+  struct Field {
+    const char *name;
+    unsigned guest;
+    unsigned native;
+  };
+  const Field fields[] = {
+      {"AF", guest.af.uint16_value, native.af.uint16_value},
+      {"BC", guest.bc.uint16_value, native.bc.uint16_value},
+      {"DE", guest.de.uint16_value, native.de.uint16_value},
+      {"HL", guest.hl.uint16_value, native.hl.uint16_value},
+      {"IX", guest.ix_iy[0].uint16_value, native.ix_iy[0].uint16_value},
+      {"IY", guest.ix_iy[1].uint16_value, native.ix_iy[1].uint16_value},
+      {"AF'", guest.af_.uint16_value, native.af_.uint16_value},
+      {"BC'", guest.bc_.uint16_value, native.bc_.uint16_value},
+      {"DE'", guest.de_.uint16_value, native.de_.uint16_value},
+      {"HL'", guest.hl_.uint16_value, native.hl_.uint16_value},
+      {"MEMPTR", guest.memptr.uint16_value, native.memptr.uint16_value},
+      {"I", guest.i, native.i},
+      {"R", guest.r & 0x7fu, native.r & 0x7fu},
+      {"T-states", static_cast<unsigned>(guest_cycles),
+       static_cast<unsigned>(native_cycles)},
+  };
+  for (const Field &field : fields) {
+    if (field.guest != field.native) {
+      return disable(std::format("{} is {:X}h, the guest code gives {:X}h",
+                                 field.name, field.native, field.guest));
+    }
+  }
+  for (uint32_t i = 0; i < sizeof(machine.memory); i++) {
+    if (machine.memory[i] != guest_memory[i]) {
+      return disable(std::format("memory at {:04X}h is {:02X}h, the guest "
+                                 "code gives {:02X}h",
+                                 i, machine.memory[i], guest_memory[i]));
+    }
+  }
+  return true;
+}
+
+void Accelerator::report(std::ostream &out) const {
+  for (const auto &[address, site] : sites) {
+    out << std::format("Native {:<10} {:04X}h: {} calls{}\n",
+                       site.routine->name, address, site.calls,
+                       site.changed    ? " (code changed)"
+                       : site.disabled ? " (disabled)"
+                                       : "");
+  }
+  out.flush();
+}
@@ -0,0 +1,1475 @@
+#include <algorithm>
+#include <bdos.hpp>
+#include <bitset>
+#include <cctype>
+#include <chrono>
+#include <console.hpp>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <format>
+#include <iostream>
+#include <machine.hpp>
+#include <string>
+#include <system_error>
+#include <thread>
+
+// Drive A: geometry presented through the DPB: 4K blocks, 8 MB
+static constexpr uint16_t BLOCK_SIZE = 4096;
+static constexpr uint16_t DISK_BLOCKS = 2048;
+static constexpr uint16_t DIRECTORY_ENTRIES = 1024;
+// Blocks taken by the directory (1024 entries of 32 bytes)
+static constexpr uint16_t DIRECTORY_BLOCKS = DIRECTORY_ENTRIES * 32 / BLOCK_SIZE;
+static constexpr uint16_t RECORDS_PER_BLOCK = BLOCK_SIZE / 128;
+
+// How often a handle reading from a cached copy checks whether the host file
+// has changed under it
+static constexpr auto HOST_CHECK_INTERVAL = std::chrono::milliseconds(100);
+
+// -- Helpers ------------------------------------------------------------------
+
+static std::string get_filename_from_fcb(const FileControlBlock &fcb) {
+  std::string name = std::format("{:.8}", (char *)fcb.f);
+  std::string type = std::format("{:.3}", (char *)fcb.t);
+
+  name.erase(name.find_last_not_of(' ') + 1);
+  type.erase(type.find_last_not_of(' ') + 1);
+
+  return std::format("{}.{}", name, type);
+}
+
+static bool fill_field(std::string_view text, uint8_t *field, size_t size) {
+  std::memset(field, ' ', size);
+  for (size_t i = 0; i < text.size(); i++) {
+    char ch = text[i];
+    if (ch == '*') {
+      std::memset(field + i, '?', size - std::min(i, size));
+      return true;
+    }
+    if (i >= size || std::strchr("<>.,;:=[]%|()/\\", ch) || ch <= ' ') {
+      return false;
+    }
+    field[i] =
+        static_cast<uint8_t>(std::toupper(static_cast<unsigned char>(ch)));
+  }
+  return true;
+}
+
+bool parse_filename(std::string_view text, FileControlBlock &fcb) {
+  std::memset(&fcb, 0, sizeof(fcb));
+  if (text.size() >= 2 && text[1] == ':') {
+    char drive = std::toupper(static_cast<unsigned char>(text[0]));
+    if (drive < 'A' || drive > 'P') {
+      return false;
+    }
+    fcb.dr = static_cast<uint8_t>(drive - 'A' + 1);
+    text.remove_prefix(2);
+  }
+
+  size_t dot = text.find('.');
+  std::string_view name = text.substr(0, dot);
+  std::string_view type =
+      dot == std::string_view::npos ? std::string_view{} : text.substr(dot + 1);
+  return fill_field(name, fcb.f, sizeof(fcb.f)) &&
+         fill_field(type, fcb.t, sizeof(fcb.t));
+}
+
+std::vector<std::string> find_files(const FileControlBlock &pattern) {
+  std::vector<std::string> found;
+  std::error_code ec;
+  for (const auto &entry : std::filesystem::directory_iterator(".", ec)) {
+    if (!entry.is_regular_file(ec)) {
+      continue;
+    }
+    std::string host = entry.path().filename().string();
+    FileControlBlock fcb;
+    if (host.find_first_of("?*") != std::string::npos ||
+        std::count(host.begin(), host.end(), '.') > 1 ||
+        !parse_filename(host, fcb)) {
+      continue;
+    }
+
+    bool matches = true;
+    for (size_t i = 0; i < 11 && matches; i++) {
+      uint8_t want = i < 8 ? pattern.f[i] : pattern.t[i - 8];
+      uint8_t have = i < 8 ? fcb.f[i] : fcb.t[i - 8];
+      matches = want == '?' || (want & 0x7f) == have;
+    }
+    if (matches) {
+      found.push_back(host);
+    }
+  }
+  std::sort(found.begin(), found.end());
+  return found;
+}
+
+static FileControlBlock load_fcb(Bdos &bdos, uint16_t address) {
+  FileControlBlock fcb;
+  bdos.machine.memout(&fcb, address, sizeof(fcb));
+  return fcb;
+}
+
+// Sequential-only callers may pass a 33-byte FCB, so the random record field
+// is only written back when the function defines it
+static void store_fcb(Bdos &bdos, uint16_t address, FileControlBlock &fcb,
+                      bool random_record = false) {
+  bdos.machine.memin(address, &fcb,
+                     random_record ? sizeof(fcb)
+                                   : offsetof(FileControlBlock, r));
+}
+
+// Error return for file functions: CP/M 2.2 only reports A=FFh, later
+// versions also give the reason in H
+template <BdosProfile P> static constexpr uint16_t file_error(CpmError error) {
+  if constexpr (P == BdosProfile::Cpm22) {
+    return 0x00ff;
+  } else {
+    return static_cast<uint16_t>(error << 8) | 0xff;
+  }
+}
+
+static uint8_t to_bcd(unsigned value) {
+  return static_cast<uint8_t>((value / 10) << 4 | value % 10);
+}
+
+static unsigned from_bcd(uint8_t value) {
+  return (value >> 4) * 10 + (value & 0x0f);
+}
+
+struct CpmTime {
+  // Day 1 is 1 January 1978
+  uint16_t days;
+  uint8_t hour;
+  uint8_t minute;
+  uint8_t second;
+};
+
+static CpmTime to_cpm_time(time_t when) {
+  tm local;
+  localtime_r(&when, &local);
+  // 2922 days from 1970-01-01 to 1978-01-01
+  int64_t days = (when + local.tm_gmtoff) / 86400 - 2922 + 1;
+  return {static_cast<uint16_t>(std::clamp<int64_t>(days, 0, 0xffff)),
+          static_cast<uint8_t>(local.tm_hour),
+          static_cast<uint8_t>(local.tm_min),
+          static_cast<uint8_t>(local.tm_sec)};
+}
+
+static CpmTime cpm_now(const Bdos &bdos) {
+  return to_cpm_time(time(nullptr) + bdos.clock_offset);
+}
+
+static void store_date(Bdos &bdos, uint16_t address, const CpmTime &time) {
+  uint8_t stamp[4] = {static_cast<uint8_t>(time.days),
+                      static_cast<uint8_t>(time.days >> 8), to_bcd(time.hour),
+                      to_bcd(time.minute)};
+  bdos.machine.memin(address, stamp, sizeof(stamp));
+}
+
+static uint32_t random_record(const FileControlBlock &fcb) {
+  return fcb.r[0] | fcb.r[1] << 8 | (fcb.r[2] & 0x03) << 16;
+}
+
+static void set_random_record(FileControlBlock &fcb, uint32_t record) {
+  fcb.r[0] = static_cast<uint8_t>(record);
+  fcb.r[1] = static_cast<uint8_t>(record >> 8);
+  fcb.r[2] = static_cast<uint8_t>(record >> 16);
+}
+
+// Sequential position: CR within the 16K logical extent EX, within the 512K
+// module S2
+static uint32_t sequential_record(const FileControlBlock &fcb) {
+  return (fcb.s2 & 0x3f) * 4096u + (fcb.ex & 0x1f) * 128u + fcb.cr;
+}
+
+static void set_sequential_record(FileControlBlock &fcb, uint32_t record,
+                                  uint32_t file_records) {
+  fcb.cr = static_cast<uint8_t>(record % 128);
+  fcb.ex = static_cast<uint8_t>(record / 128 % 32);
+  fcb.s2 = static_cast<uint8_t>(record / 4096);
+  // RC: records used in the current extent
+  uint32_t extent_start = record - fcb.cr;
+  fcb.rc = static_cast<uint8_t>(
+      file_records > extent_start ? std::min(128u, file_records - extent_start)
+                                  : 0);
+}
+
+// The shared copy to read `file` from, or nullptr to read through its stream.
+// The copy is made at the first read after F_OPEN, so files that are only
+// written are never read in. It is given up once the file is written through
+// this handle, or through any other (seen as a new cache generation), or
+// changes on the host (checked every HOST_CHECK_INTERVAL).
+static const CachedFile *cached_copy(OpenFile &file, const std::string &path) {
+  FileCache &cache = FileCache::instance();
+  auto now = std::chrono::steady_clock::now();
+  if (!file.cache) {
+    if (!file.cacheable) {
+      return nullptr;
+    }
+    file.cacheable = false;
+    file.cache = cache.open(path);
+    file.cache_generation = cache.generation();
+    file.cache_checked = now;
+  } else if (file.cache_generation != cache.generation()) {
+    if (!cache.current(*file.cache)) {
+      file.cache.reset();
+      return nullptr;
+    }
+    file.cache_generation = cache.generation();
+  }
+
+  if (file.cache && now - file.cache_checked >= HOST_CHECK_INTERVAL) {
+    file.cache_checked = now;
+    if (FileCache::changed_on_host(*file.cache, path)) {
+      // Other handles reading the same copy drop it at their next read
+      cache.invalidate(file.cache->id());
+      file.cache.reset();
+    }
+  }
+  return file.cache.get();
+}
+
+static uint32_t file_records(OpenFile &file, const std::string &path) {
+  uint64_t size;
+  if (const CachedFile *cached = file.cache ? cached_copy(file, path)
+                                            : nullptr) {
+    size = cached->size();
+  } else {
+    file.stream.clear();
+    file.stream.seekg(0, std::ios::end);
+    std::streamoff end = file.stream.tellg();
+    size = end > 0 ? static_cast<uint64_t>(end) : 0;
+  }
+  return static_cast<uint32_t>((size + 127) / 128);
+}
+
+// Read the 128-byte record at `offset`, zero filling past end of file.
+// Returns how many bytes came from the file.
+static std::streamsize read_record(OpenFile &file, const std::string &path,
+                                   std::streamoff offset, char (&buffer)[128]) {
+  std::streamsize got = 0;
+  if (const CachedFile *cached = cached_copy(file, path)) {
+    if (offset < static_cast<std::streamoff>(cached->size())) {
+      got = std::min<std::streamoff>(sizeof(buffer), cached->size() - offset);
+      std::memcpy(buffer, cached->data() + offset, static_cast<size_t>(got));
+      FileCache::instance().count_record();
+    }
+  } else {
+    file.stream.clear();
+    file.stream.seekg(offset, std::ios::beg);
+    file.stream.read(buffer, sizeof(buffer));
+    got = file.stream.gcount();
+  }
+
+  if (got > 0 && got < static_cast<std::streamsize>(sizeof(buffer))) {
+    std::memset(buffer + got, 0, sizeof(buffer) - static_cast<size_t>(got));
+  }
+  return got;
+}
+
+static bool write_record(OpenFile &file, std::streamoff offset,
+                         const char (&buffer)[128]) {
+  // Written files are no longer served from the cache, by this handle or
+  // any other that has read the file since the last write
+  file.cache.reset();
+  file.cacheable = false;
+  FileCache::instance().invalidate(file.id);
+
+  file.stream.clear();
+  file.stream.seekp(offset, std::ios::beg);
+  file.stream.write(buffer, sizeof(buffer));
+  return file.stream.good();
+}
+
+static OpenFile *find_open_file(Bdos &bdos, const std::string &path) {
+  auto it = bdos.open_files.find(path);
+  return it == bdos.open_files.end() ? nullptr : &it->second;
+}
+
+// Blocks in use on the emulated drive, marked in the allocation vector
+static uint16_t update_allocation(Bdos &bdos) {
+  uint32_t used = DIRECTORY_BLOCKS;
+  FileControlBlock all;
+  parse_filename("*.*", all);
+  std::error_code ec;
+  for (const std::string &file : find_files(all)) {
+    uintmax_t size = std::filesystem::file_size(file, ec);
+    if (!ec) {
+      used += static_cast<uint32_t>((size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    }
+  }
+  used = std::min<uint32_t>(used, DISK_BLOCKS);
+
+  uint8_t *alv = &bdos.machine.memory[BDOS_ALV];
+  std::memset(alv, 0, DISK_BLOCKS / 8);
+  std::memset(alv, 0xff, used / 8);
+  if (used % 8) {
+    alv[used / 8] = static_cast<uint8_t>(0xff00 >> (used % 8));
+  }
+  return static_cast<uint16_t>(used);
+}
+
+// Fill in a directory entry for `host` at the DMA address, the way the last
+// directory entry of the file would look
+static void store_directory_entry(Bdos &bdos, const std::string &host) {
+  uint8_t entry[32] = {};
+  FileControlBlock fcb;
+  parse_filename(host, fcb);
+  entry[0] = static_cast<uint8_t>(bdos.machine.memory[0x0004] >> 4); // User
+  std::memcpy(&entry[1], fcb.f, 8);
+  std::memcpy(&entry[9], fcb.t, 3);
+
+  std::error_code ec;
+  uintmax_t size = std::filesystem::file_size(host, ec);
+  uint32_t records = ec ? 0 : static_cast<uint32_t>((size + 127) / 128);
+  if (records) {
+    uint32_t extent = (records - 1) / 128;
+    entry[12] = static_cast<uint8_t>(extent % 32);
+    entry[14] = static_cast<uint8_t>(extent / 32);
+    entry[15] = static_cast<uint8_t>(records - extent * 128);
+
+    // EXM=1: each entry covers two logical extents, blocks are 16-bit
+    uint32_t in_entry = records - (extent & ~1u) * 128;
+    uint32_t blocks = (in_entry + RECORDS_PER_BLOCK - 1) / RECORDS_PER_BLOCK;
+    for (uint32_t i = 0; i < blocks && i < 8; i++) {
+      uint16_t block = static_cast<uint16_t>(DIRECTORY_BLOCKS + i);
+      entry[16 + i * 2] = static_cast<uint8_t>(block);
+      entry[17 + i * 2] = static_cast<uint8_t>(block >> 8);
+    }
+  }
+  bdos.machine.memin(bdos.dma_address, entry, sizeof(entry));
+}
+
+// -- Console ------------------------------------------------------------------
+
+static uint16_t p_termcpm(Bdos &bdos, uint16_t) {
+  bdos.machine.stop();
+  return 0;
+}
+
+static uint16_t c_read(Bdos &bdos, uint16_t) {
+  int ch = read_console_char();
+  if (ch < 0) {
+    return 0x1a; // ^Z at end of input
+  }
+  if (ch == '\n') {
+    ch = '\r';
+  }
+  char echo = static_cast<char>(ch);
+  bdos.machine.terminal.write(std::string_view(&echo, 1));
+  bdos.machine.terminal.flush();
+  return static_cast<uint8_t>(ch);
+}
+
+static uint16_t c_write(Bdos &bdos, uint16_t arg) {
+  char ch = static_cast<char>(arg & 0xff);
+  bdos.machine.terminal.write(std::string_view(&ch, 1));
+  bdos.machine.terminal.flush();
+  return 0;
+}
+
+static uint16_t a_read(Bdos &, uint16_t) {
+  // No auxiliary device is attached: reading it gives end of file
+  return 0x1a;
+}
+
+static uint16_t a_write(Bdos &, uint16_t) { return 0; }
+
+static uint16_t l_write(Bdos &, uint16_t arg) {
+  // The list device is the host's stderr, away from the console stream
+  std::cerr << static_cast<char>(arg & 0xff);
+  return 0;
+}
+
+template <BdosProfile P> static uint16_t c_rawio(Bdos &bdos, uint16_t arg) {
+  uint8_t code = static_cast<uint8_t>(arg & 0xff);
+  if (code == 0xff) {
+    // CP/M 2.2/3: Non-blocking raw console read, no echo
+    if (!console_has_char()) {
+      return 0; // No character available
+    }
+    int ch = read_console_char();
+    if (ch < 0) {
+      return 0; // No character read
+    }
+    return static_cast<uint8_t>(ch == '\n' ? '\r' : ch);
+  }
+  if constexpr (P == BdosProfile::Cpm3) {
+    if (code == 0xfe) {
+      // Console status
+      return console_has_char() ? 0xff : 0x00;
+    }
+    if (code == 0xfd) {
+      // Blocking read, no echo
+      int ch = read_console_char();
+      return ch < 0 ? 0x1a : static_cast<uint8_t>(ch == '\n' ? '\r' : ch);
+    }
+  }
+
+  // Values of E not supported output the character
+  bdos.machine.terminal.write(
+      std::string_view(reinterpret_cast<const char *>(&code), 1));
+  bdos.machine.terminal.flush();
+  return code;
+}
+
+template <BdosProfile P> static uint16_t a_statin(Bdos &bdos, uint16_t) {
+  if constexpr (P == BdosProfile::Cpm3) {
+    // Auxiliary input status: never ready
+    return 0x00;
+  } else {
+    // Get IOBYTE
+    return bdos.machine.memory[0x0003];
+  }
+}
+
+template <BdosProfile P>
+static uint16_t a_statout(Bdos &bdos, uint16_t arg) {
+  if constexpr (P == BdosProfile::Cpm3) {
+    // Auxiliary output status: output is discarded, so always ready
+    return 0xff;
+  } else {
+    // Set IOBYTE
+    bdos.machine.memory[0x0003] = static_cast<uint8_t>(arg);
+    return 0;
+  }
+}
+
+static uint16_t c_writestr(Bdos &bdos, uint16_t arg) {
+  // Output the string at DE up to the delimiter ('$' unless changed by
+  // C_DELIMIT). The string may run off the top of memory and carry on from
+  // 0000h; memchr does the scanning so long strings cost one pass rather than
+  // a call per character.
+  Terminal &terminal = bdos.machine.terminal;
+  if (!bdos.machine.traps.empty()) {
+    // Trapped bytes must read as the code they replaced, so go through peek()
+    std::string text;
+    uint16_t address = arg;
+    do {
+      char ch = static_cast<char>(bdos.machine.peek(address));
+      if (ch == bdos.delimiter) {
+        break;
+      }
+      text += ch;
+    } while (++address != arg);
+    terminal.write(text);
+    terminal.flush();
+    return 0;
+  }
+  const char *memory = reinterpret_cast<const char *>(bdos.machine.memory);
+  const char *start = memory + arg;
+  const char *top = memory + sizeof(bdos.machine.memory);
+  const char *end = static_cast<const char *>(
+      std::memchr(start, bdos.delimiter, top - start));
+  if (end) {
+    terminal.write(std::string_view(start, end));
+  } else {
+    terminal.write(std::string_view(start, top));
+    // A string with no terminator at all is cut off after one lap
+    end = static_cast<const char *>(std::memchr(memory, bdos.delimiter, arg));
+    terminal.write(std::string_view(memory, end ? end : start));
+  }
+  terminal.flush();
+  return 0;
+}
+
+static uint16_t c_readstr(Bdos &bdos, uint16_t arg) {
+  // CP/M 2.2/3 buffered console input:
+  // buffer[0] = max size, buffer[1] = current length, buffer[2..] = data
+  Machine &machine = bdos.machine;
+  std::string line;
+  read_console_line(line, 256);
+  char *buffer = line.data();
+  uint16_t index = static_cast<uint16_t>(line.size());
+
+  // Use DMA buffer when DE is 0, otherwise the buffer at DE
+  uint16_t address = arg == 0 ? bdos.dma_address : arg;
+  uint8_t size = 0;
+  machine.memout(&size, address, 1);
+  if (size < 2) {
+    size = 2;
+  }
+  uint8_t len = std::min<uint8_t>(static_cast<uint8_t>(size - 2), index);
+  machine.memin(address + 1, &len, 1);
+  if (len > 0) {
+    machine.memin(address + 2, buffer, len);
+  }
+  return 0; // Success
+}
+
+static uint16_t c_stat(Bdos &, uint16_t) {
+  return console_has_char() ? 0xff : 0x00;
+}
+
+template <BdosProfile P> static uint16_t s_bdosver(Bdos &, uint16_t) {
+  // H = system type (1 = MP/M), L = version
+  if constexpr (P == BdosProfile::Cpm22) {
+    return 0x0022;
+  } else if constexpr (P == BdosProfile::Cpm3) {
+    return 0x0031;
+  } else {
+    return 0x0130;
+  }
+}
+
+static uint16_t c_mode(Bdos &bdos, uint16_t arg) {
+  if (arg == 0xffff) {
+    return bdos.console_mode;
+  }
+  bdos.console_mode = arg;
+  return 0;
+}
+
+static uint16_t c_delimit(Bdos &bdos, uint16_t arg) {
+  if (arg == 0xffff) {
+    return static_cast<uint8_t>(bdos.delimiter);
+  }
+  bdos.delimiter = static_cast<char>(arg & 0xff);
+  return 0;
+}
+
+// C_WRITEBLK / L_WRITEBLK: DE points at a CCB of address and length
+static std::string character_block(Bdos &bdos, uint16_t arg) {
+  uint8_t ccb[4];
+  bdos.machine.memout(ccb, arg, sizeof(ccb));
+  uint16_t address = static_cast<uint16_t>(ccb[0] | ccb[1] << 8);
+  uint16_t length = static_cast<uint16_t>(ccb[2] | ccb[3] << 8);
+  length = std::min<uint16_t>(length, 0x10000 - address);
+  std::string block(length, '\0');
+  bdos.machine.memout(block.data(), address, length);
+  return block;
+}
+
+static uint16_t c_writeblk(Bdos &bdos, uint16_t arg) {
+  bdos.machine.terminal.write(character_block(bdos, arg));
+  bdos.machine.terminal.flush();
+  return 0;
+}
+
+static uint16_t l_writeblk(Bdos &bdos, uint16_t arg) {
+  std::cerr << character_block(bdos, arg);
+  return 0;
+}
+
+// -- Drives -------------------------------------------------------------------
+
+static uint16_t drv_allreset(Bdos &bdos, uint16_t) {
+  // Single-drive system: back to A: with the default DMA
+  bdos.dma_address = 0x0080;
+  bdos.readonly_vector = 0;
+  bdos.machine.memory[0x0004] &= 0xf0;
+  return 0;
+}
+
+template <BdosProfile P> static uint16_t drv_set(Bdos &, uint16_t arg) {
+  // Only drive A: (0) is valid
+  return (arg & 0xff) == 0 ? 0x0000 : file_error<P>(SelectError);
+}
+
+static uint16_t drv_loginvec(Bdos &, uint16_t) {
+  // Only A: is logged in
+  return 0x0001;
+}
+
+static uint16_t drv_get(Bdos &, uint16_t) {
+  // Always drive A: (0)
+  return 0;
+}
+
+static uint16_t f_dmaoff(Bdos &bdos, uint16_t arg) {
+  bdos.dma_address = arg;
+  return 0;
+}
+
+static uint16_t drv_allocvec(Bdos &bdos, uint16_t) {
+  update_allocation(bdos);
+  return BDOS_ALV;
+}
+
+static uint16_t drv_setro(Bdos &bdos, uint16_t) {
+  bdos.readonly_vector |= 0x0001;
+  return 0;
+}
+
+static uint16_t drv_rovec(Bdos &bdos, uint16_t) {
+  return bdos.readonly_vector;
+}
+
+static uint16_t drv_dpb(Bdos &, uint16_t) { return BDOS_DPB; }
+
+static uint16_t f_usernum(Bdos &bdos, uint16_t arg) {
+  // 0004: high nibble is the current user number
+  uint8_t &drive_user = bdos.machine.memory[0x0004];
+  if ((arg & 0xff) == 0xff) {
+    return drive_user >> 4;
+  }
+  drive_user = static_cast<uint8_t>((arg & 0x0f) << 4 | (drive_user & 0x0f));
+  return 0;
+}
+
+static uint16_t drv_reset(Bdos &bdos, uint16_t arg) {
+  bdos.readonly_vector &= static_cast<uint16_t>(~arg);
+  return 0;
+}
+
+static uint16_t success(Bdos &, uint16_t) { return 0; }
+
+template <BdosProfile P> static uint16_t drv_space(Bdos &bdos, uint16_t arg) {
+  if ((arg & 0xff) != 0) {
+    return file_error<P>(SelectError);
+  }
+  // Free 128-byte records, as a 24-bit number at the DMA address
+  uint32_t free_records =
+      static_cast<uint32_t>(DISK_BLOCKS - update_allocation(bdos)) *
+      RECORDS_PER_BLOCK;
+  uint8_t bytes[3] = {static_cast<uint8_t>(free_records),
+                      static_cast<uint8_t>(free_records >> 8),
+                      static_cast<uint8_t>(free_records >> 16)};
+  bdos.machine.memin(bdos.dma_address, bytes, sizeof(bytes));
+  return 0;
+}
+
+static uint16_t drv_flush(Bdos &bdos, uint16_t) {
+  for (auto &[path, file] : bdos.open_files) {
+    file.stream.flush();
+  }
+  return 0;
+}
+
+static uint16_t drv_getlabel(Bdos &, uint16_t) {
+  // No directory label: no time stamps or passwords
+  return 0;
+}
+
+// -- Files --------------------------------------------------------------------
+
+template <BdosProfile P> static uint16_t f_open(Bdos &bdos, uint16_t arg) {
+  FileControlBlock fcb = load_fcb(bdos, arg);
+
+  std::string path = get_filename_from_fcb(fcb);
+  if (path.find('?') != std::string::npos) {
+    // Wildcards not allowed for F_OPEN
+    return file_error<P>(FilenameContainsWildcard);
+  }
+
+  OpenFile *file = find_open_file(bdos, path);
+  if (file && P == BdosProfile::Mpm) {
+    // MP/M locks files to the FCB that opened them
+    return file_error<P>(FileAlreadyOpen);
+  }
+  if (!file) {
+    OpenFile opened;
+    opened.stream.open(path, std::ios::in | std::ios::out | std::ios::binary);
+    if (!opened.stream.is_open()) {
+      // Read-only host files can still be opened for reading
+      opened.stream.open(path, std::ios::in | std::ios::binary);
+    }
+    if (!opened.stream.is_open()) {
+      // File not found or other software-level error
+      return file_error<P>(SoftwareError);
+    }
+    opened.id = file_id(path);
+    file = &(bdos.open_files[path] = std::move(opened));
+  } else {
+    // Opening again picks up changes made on the host, and anything written
+    // through this handle, at the next read
+    file->stream.flush();
+    file->cache.reset();
+    file->cacheable = true;
+    file->id = file_id(path);
+  }
+
+  // Start at the extent the caller asked for, with RC filled in
+  fcb.s2 = 0;
+  uint8_t cr = fcb.cr;
+  set_sequential_record(fcb, fcb.ex * 128u, file_records(*file, path));
+  fcb.cr = cr;
+  store_fcb(bdos, arg, fcb);
+  return 0; // Success (A=0)
+}
+
+static uint16_t f_close(Bdos &bdos, uint16_t arg) {
+  FileControlBlock fcb = load_fcb(bdos, arg);
+
+  std::string path = get_filename_from_fcb(fcb);
+  auto it = bdos.open_files.find(path);
+  if (it == bdos.open_files.end()) {
+    // Closing an unopened file just updates its directory entry
+    std::error_code ec;
+    return std::filesystem::is_regular_file(path, ec) ? 0x0000 : 0x00ff;
+  }
+
+  it->second.stream.close();
+  bdos.open_files.erase(it);
+  return 0; // Success
+}
+
+static uint16_t search_result(Bdos &bdos) {
+  if (bdos.search_next >= bdos.search_results.size()) {
+    return 0x00ff; // No more files
+  }
+  store_directory_entry(bdos, bdos.search_results[bdos.search_next++]);
+  return 0; // Entry 0 of the DMA buffer
+}
+
+static uint16_t f_sfirst(Bdos &bdos, uint16_t arg) {
+  FileControlBlock fcb = load_fcb(bdos, arg);
+  if (fcb.dr == '?') {
+    // Match every directory entry
+    parse_filename("*.*", fcb);
+  }
+  bdos.search_results = find_files(fcb);
+  bdos.search_next = 0;
+  return search_result(bdos);
+}
+
+static uint16_t f_snext(Bdos &bdos, uint16_t) { return search_result(bdos); }
+
+template <BdosProfile P> static uint16_t f_delete(Bdos &bdos, uint16_t arg) {
+  FileControlBlock fcb = load_fcb(bdos, arg);
+
+  std::vector<std::string> files = find_files(fcb);
+  if (files.empty()) {
+    return file_error<P>(SoftwareError);
+  }
+  if constexpr (P == BdosProfile::Mpm) {
+    for (const std::string &file : files) {
+      if (find_open_file(bdos, file)) {
+        // MP/M does not allow deleting files that are open
+        return file_error<P>(FileAlreadyOpen);
+      }
+    }
+  }
+
+  for (const std::string &file : files) {
+    bdos.open_files.erase(file);
+    FileCache::instance().invalidate(file);
+    if (std::remove(file.c_str()) != 0) {
+      return file_error<P>(SoftwareError);
+    }
+  }
+  return 0; // Success
+}
+
+template <BdosProfile P> static uint16_t f_read(Bdos &bdos, uint16_t arg) {
+  FileControlBlock fcb = load_fcb(bdos, arg);
+
+  std::string path = get_filename_from_fcb(fcb);
+  OpenFile *file = find_open_file(bdos, path);
+  if (!file) {
+    return 9; // Invalid FCB / file not open
+  }
+
+  uint32_t records = file_records(*file, path);
+  uint32_t record = sequential_record(fcb);
+  uint16_t dma = bdos.dma_address;
+  uint16_t result = 0;
+  for (unsigned i = 0; i < bdos.multisector_count; i++, dma += 128) {
+    char buffer[128];
+    if (read_record(*file, path, static_cast<std::streamoff>(record) * 128,
+                    buffer) <= 0) {
+      // End of file; H is the number of records read (CP/M 3)
+      result = P == BdosProfile::Cpm3 ? static_cast<uint16_t>(i << 8 | 1) : 1;
+      break;
+    }
+    bdos.machine.memin(dma, buffer, sizeof(buffer));
+    record++;
+  }
+
+  set_sequential_record(fcb, record, records);
+  store_fcb(bdos, arg, fcb);
+  return result;
+}
+
+template <BdosProfile P> static uint16_t f_write(Bdos &bdos, uint16_t arg) {
+  FileControlBlock fcb = load_fcb(bdos, arg);
+
+  std::string path = get_filename_from_fcb(fcb);
+  OpenFile *file = find_open_file(bdos, path);
+  if (!file) {
+    return 9; // Invalid FCB / file not open
+  }
+  if (bdos.readonly_vector & 1) {
+    return file_error<P>(DiskReadOnly);
+  }
+
+  uint32_t record = sequential_record(fcb);
+  uint16_t dma = bdos.dma_address;
+  for (unsigned i = 0; i < bdos.multisector_count; i++, dma += 128) {
+    char buffer[128];
+    bdos.machine.memout(buffer, dma, sizeof(buffer));
+    if (!write_record(*file, static_cast<std::streamoff>(record) * 128,
+                      buffer)) {
+      // Treat as software-level error (disk full etc.)
+      return file_error<P>(SoftwareError);
+    }
+    record++;
+  }
+
+  set_sequential_record(fcb, record,
+                        std::max(record, file_records(*file, path)));
+  store_fcb(bdos, arg, fcb);
+  return 0; // Success
+}
+
+template <BdosProfile P> static uint16_t f_make(Bdos &bdos, uint16_t arg) {
+  FileControlBlock fcb = load_fcb(bdos, arg);
+
+  std::string path = get_filename_from_fcb(fcb);
+  if (find_open_file(bdos, path)) {
+    return file_error<P>(FileAlreadyExists);
+  }
+
+  if (path.find('?') != std::string::npos) {
+    // Wildcards not allowed for F_MAKE
+    return file_error<P>(FilenameContainsWildcard);
+  }
+
+  // CP/M F_MAKE creates and opens the file for subsequent writes.
+  FileCache::instance().invalidate(path);
+  {
+    std::fstream file;
+    file.open(path, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+      return file_error<P>(SoftwareError);
+    }
+    file.close();
+  }
+
+  OpenFile rwfile;
+  rwfile.stream.open(path, std::ios::in | std::ios::out | std::ios::binary);
+  if (!rwfile.stream.is_open()) {
+    // Creation succeeded but reopen for R/W failed: treat as software error
+    return file_error<P>(SoftwareError);
+  }
+
+  rwfile.id = file_id(path);
+  bdos.open_files[path] = std::move(rwfile);
+  // The file is now open at record 0 for sequential F_WRITE calls.
+  set_sequential_record(fcb, 0, 0);
+  store_fcb(bdos, arg, fcb);
+  return 0; // Success
+}
+
+template <BdosProfile P> static uint16_t f_rename(Bdos &bdos, uint16_t arg) {
+  // DE points at the old name, followed 16 bytes later by the new one
+  FileControlBlock from = load_fcb(bdos, arg);
+  FileControlBlock to = load_fcb(bdos, arg + 16);
+
+  std::string old_path = get_filename_from_fcb(from);
+  std::string new_path = get_filename_from_fcb(to);
+  if ((old_path + new_path).find('?') != std::string::npos) {
+    return file_error<P>(FilenameContainsWildcard);
+  }
+  std::error_code ec;
+  if (std::filesystem::exists(new_path, ec)) {
+    return file_error<P>(FileAlreadyExists);
+  }
+
+  FileCache::instance().invalidate(old_path);
+  std::filesystem::rename(old_path, new_path, ec);
+  if (ec) {
+    return file_error<P>(SoftwareError);
+  }
+  if (auto it = bdos.open_files.find(old_path); it != bdos.open_files.end()) {
+    auto node = bdos.open_files.extract(it);
+    node.key() = new_path;
+    bdos.open_files.insert(std::move(node));
+  }
+  return 0;
+}
+
+template <BdosProfile P> static uint16_t f_attrib(Bdos &bdos, uint16_t arg) {
+  // Attributes have no host equivalent; just check the file is there
+  FileControlBlock fcb = load_fcb(bdos, arg);
+  return find_files(fcb).empty() ? file_error<P>(SoftwareError) : 0;
+}
+
+template <BdosProfile P>
+static uint16_t f_readrand(Bdos &bdos, uint16_t arg) {
+  FileControlBlock fcb = load_fcb(bdos, arg);
+
+  std::string path = get_filename_from_fcb(fcb);
+  OpenFile *file = find_open_file(bdos, path);
+  if (!file) {
+    return 9; // Invalid FCB / file not open
+  }
+  if (fcb.r[2] > 3) {
+    return 6; // Record out of range
+  }
+
+  uint32_t record = random_record(fcb);
+  uint16_t dma = bdos.dma_address;
+  for (unsigned i = 0; i < bdos.multisector_count; i++, dma += 128) {
+    char buffer[128];
+    std::streamoff offset = static_cast<std::streamoff>(record + i) * 128;
+    if (read_record(*file, path, offset, buffer) <= 0) {
+      // Reading unwritten data / beyond EOF
+      return P == BdosProfile::Cpm3 ? static_cast<uint16_t>(i << 8 | 1) : 1;
+    }
+    bdos.machine.memin(dma, buffer, sizeof(buffer));
+  }
+
+  // A following sequential read re-reads this record, as in CP/M
+  set_sequential_record(fcb, record, file_records(*file, path));
+  store_fcb(bdos, arg, fcb);
+  return 0; // Success
+}
+
+template <BdosProfile P>
+static uint16_t f_writerand(Bdos &bdos, uint16_t arg) {
+  FileControlBlock fcb = load_fcb(bdos, arg);
+
+  std::string path = get_filename_from_fcb(fcb);
+  OpenFile *file = find_open_file(bdos, path);
+  if (!file) {
+    return 9; // Invalid FCB / file not open
+  }
+  if (fcb.r[2] > 3) {
+    return 6; // Record out of range
+  }
+  if (bdos.readonly_vector & 1) {
+    return file_error<P>(DiskReadOnly);
+  }
+
+  // Writing past the end leaves a gap that reads back as zeros, so this
+  // also serves F_WRITEZF
+  uint32_t record = random_record(fcb);
+  uint16_t dma = bdos.dma_address;
+  for (unsigned i = 0; i < bdos.multisector_count; i++, dma += 128) {
+    char buffer[128];
+    bdos.machine.memout(buffer, dma, sizeof(buffer));
+    std::streamoff offset = static_cast<std::streamoff>(record + i) * 128;
+    if (!write_record(*file, offset, buffer)) {
+      return file_error<P>(SoftwareError);
+    }
+  }
+
+  set_sequential_record(fcb, record, file_records(*file, path));
+  store_fcb(bdos, arg, fcb);
+  return 0;
+}
+
+template <BdosProfile P> static uint16_t f_size(Bdos &bdos, uint16_t arg) {
+  FileControlBlock fcb = load_fcb(bdos, arg);
+
+  std::string path = get_filename_from_fcb(fcb);
+  std::error_code ec;
+  uintmax_t size = std::filesystem::file_size(path, ec);
+  if (ec) {
+    return file_error<P>(SoftwareError);
+  }
+  if (OpenFile *file = find_open_file(bdos, path)) {
+    // Include writes still buffered in the stream
+    file->stream.flush();
+    size = std::filesystem::file_size(path, ec);
+  }
+
+  set_random_record(fcb, static_cast<uint32_t>((size + 127) / 128));
+  store_fcb(bdos, arg, fcb, true);
+  return 0;
+}
+
+static uint16_t f_randrec(Bdos &bdos, uint16_t arg) {
+  FileControlBlock fcb = load_fcb(bdos, arg);
+  set_random_record(fcb, sequential_record(fcb));
+  store_fcb(bdos, arg, fcb, true);
+  return 0;
+}
+
+static uint16_t f_multisec(Bdos &bdos, uint16_t arg) {
+  uint8_t count = static_cast<uint8_t>(arg);
+  if (count < 1 || count > 128) {
+    return 0x00ff;
+  }
+  bdos.multisector_count = count;
+  return 0;
+}
+
+static uint16_t f_errmode(Bdos &bdos, uint16_t arg) {
+  bdos.error_mode = static_cast<uint8_t>(arg);
+  return 0;
+}
+
+template <BdosProfile P> static uint16_t f_truncate(Bdos &bdos, uint16_t arg) {
+  // Truncate so the random record field is the last record kept
+  FileControlBlock fcb = load_fcb(bdos, arg);
+  std::string path = get_filename_from_fcb(fcb);
+  if (OpenFile *file = find_open_file(bdos, path)) {
+    file->stream.flush();
+  }
+
+  FileCache::instance().invalidate(path);
+  std::error_code ec;
+  std::filesystem::resize_file(
+      path, static_cast<uintmax_t>(random_record(fcb) + 1) * 128, ec);
+  if (ec) {
+    return file_error<P>(SoftwareError);
+  }
+  if (OpenFile *file = find_open_file(bdos, path)) {
+    file->cache.reset();
+  }
+  return 0;
+}
+
+template <BdosProfile P> static uint16_t f_timedate(Bdos &bdos, uint16_t arg) {
+  // Fills FCB bytes 24–27 (create/access) and 28–31 (update) with the host
+  // modification time
+  FileControlBlock fcb = load_fcb(bdos, arg);
+  std::string path = get_filename_from_fcb(fcb);
+  std::error_code ec;
+  auto modified = std::filesystem::last_write_time(path, ec);
+  if (ec) {
+    return file_error<P>(SoftwareError);
+  }
+
+  auto system = std::chrono::file_clock::to_sys(modified);
+  CpmTime stamp = to_cpm_time(std::chrono::system_clock::to_time_t(
+      std::chrono::time_point_cast<std::chrono::system_clock::duration>(
+          system)));
+  store_date(bdos, arg + 24, stamp);
+  store_date(bdos, arg + 28, stamp);
+  return 0;
+}
+
+static uint16_t f_parse(Bdos &bdos, uint16_t arg) {
+  // DE points at a PFCB: address of the text, then of the FCB to fill
+  uint8_t pfcb[4];
+  bdos.machine.memout(pfcb, arg, sizeof(pfcb));
+  uint16_t text = static_cast<uint16_t>(pfcb[0] | pfcb[1] << 8);
+  uint16_t target = static_cast<uint16_t>(pfcb[2] | pfcb[3] << 8);
+  const Machine &machine = bdos.machine;
+
+  auto is_blank = [](uint8_t ch) { return ch == ' ' || ch == '\t'; };
+  auto is_end = [](uint8_t ch) { return ch == 0 || ch == '\r'; };
+  auto is_delimiter = [&](uint8_t ch) {
+    return is_blank(ch) || is_end(ch) || std::strchr("=<>,|[]/;", ch);
+  };
+
+  while (is_blank(machine.peek(text))) {
+    text++;
+  }
+  std::string name;
+  while (!is_delimiter(machine.peek(text)) && name.size() < 16) {
+    name += static_cast<char>(machine.peek(text++));
+  }
+
+  FileControlBlock fcb;
+  if (!parse_filename(name, fcb)) {
+    return 0xffff; // Invalid file name
+  }
+  // Drive, name, type and S1/S2/RC cleared, then a blank password
+  uint8_t bytes[24];
+  std::memcpy(bytes, &fcb, 16);
+  std::memset(bytes + 16, ' ', 8);
+  bdos.machine.memin(target, bytes, sizeof(bytes));
+
+  while (is_blank(machine.peek(text))) {
+    text++;
+  }
+  // 0000h at end of line, otherwise the address of the delimiter
+  return is_end(machine.peek(text)) ? 0x0000 : text;
+}
+
+// -- System -------------------------------------------------------------------
+
+static uint16_t p_chain(Bdos &bdos, uint16_t) {
+  // The command line to chain to is NUL terminated at the default DMA
+  char line[0x80];
+  bdos.machine.memout(line, 0x80, sizeof(line));
+  bdos.chain_command.assign(line, strnlen(line, sizeof(line)));
+  bdos.machine.stop();
+  return 0;
+}
+
+static uint16_t s_scb(Bdos &bdos, uint16_t arg) {
+  // SCB parameter block: offset, operation (0 = get, FFh = set byte,
+  // FEh = set word), value
+  uint8_t pb[4];
+  bdos.machine.memout(pb, arg, sizeof(pb));
+  uint8_t offset = pb[0];
+  if (offset >= bdos.scb.size() - 1) {
+    return 0;
+  }
+
+  // Fields that mirror BDOS state
+  uint8_t &drive_user = bdos.machine.memory[0x0004];
+  auto sync_from_state = [&] {
+    bdos.scb[0x10] = static_cast<uint8_t>(bdos.return_code);
+    bdos.scb[0x11] = static_cast<uint8_t>(bdos.return_code >> 8);
+    bdos.scb[0x33] = static_cast<uint8_t>(bdos.console_mode);
+    bdos.scb[0x34] = static_cast<uint8_t>(bdos.console_mode >> 8);
+    bdos.scb[0x37] = static_cast<uint8_t>(bdos.delimiter);
+    bdos.scb[0x3c] = static_cast<uint8_t>(bdos.dma_address);
+    bdos.scb[0x3d] = static_cast<uint8_t>(bdos.dma_address >> 8);
+    bdos.scb[0x3e] = static_cast<uint8_t>(drive_user & 0x0f);
+    bdos.scb[0x44] = static_cast<uint8_t>(drive_user >> 4);
+  };
+  sync_from_state();
+
+  if (pb[1] == 0xff) {
+    bdos.scb[offset] = pb[2];
+  } else if (pb[1] == 0xfe) {
+    bdos.scb[offset] = pb[2];
+    bdos.scb[offset + 1] = pb[3];
+  } else {
+    return static_cast<uint16_t>(bdos.scb[offset] | bdos.scb[offset + 1] << 8);
+  }
+
+  bdos.return_code = static_cast<uint16_t>(bdos.scb[0x10] | bdos.scb[0x11] << 8);
+  bdos.console_mode =
+      static_cast<uint16_t>(bdos.scb[0x33] | bdos.scb[0x34] << 8);
+  bdos.delimiter = static_cast<char>(bdos.scb[0x37]);
+  bdos.dma_address = static_cast<uint16_t>(bdos.scb[0x3c] | bdos.scb[0x3d] << 8);
+  drive_user = static_cast<uint8_t>(bdos.scb[0x44] << 4 | (drive_user & 0x0f));
+  return 0;
+}
+
+static uint16_t s_bios(Bdos &bdos, uint16_t arg) {
+  // BIOS parameter block: function, A, BC, DE, HL
+  uint8_t pb[8];
+  bdos.machine.memout(pb, arg, sizeof(pb));
+  uint8_t c = pb[2];
+  switch (pb[0]) {
+  case 1: // WBOOT
+    bdos.machine.stop();
+    return 0;
+  case 2: // CONST
+    return console_has_char() ? 0xff : 0x00;
+  case 3: { // CONIN
+    int ch = read_console_char();
+    return ch < 0 ? 0x1a : static_cast<uint8_t>(ch == '\n' ? '\r' : ch);
+  }
+  case 4: // CONOUT
+    return c_write(bdos, c);
+  case 5: // LIST
+    return l_write(bdos, c);
+  case 6: // AUXOUT
+    return a_write(bdos, c);
+  case 7: // AUXIN
+    return a_read(bdos, 0);
+  case 15: // LISTST
+  case 18: // AUXOST
+    return 0xff;
+  default:
+    return 0;
+  }
+}
+
+static uint16_t p_load(Bdos &bdos, uint16_t arg) {
+  // Load the file named by the FCB at the address in its random record field
+  FileControlBlock fcb = load_fcb(bdos, arg);
+  uint16_t address = static_cast<uint16_t>(fcb.r[0] | fcb.r[1] << 8);
+  if (address < 0x0100) {
+    address = 0x0100;
+  }
+
+  std::ifstream file(get_filename_from_fcb(fcb), std::ios::binary);
+  if (!file) {
+    return 0x00ff;
+  }
+  file.read(reinterpret_cast<char *>(&bdos.machine.memory[address]),
+            BDOS_BASE - address);
+  if (file.gcount() == BDOS_BASE - address && file.peek() != EOF) {
+    return 0x00fe; // Does not fit below the BDOS
+  }
+  return 0;
+}
+
+static uint16_t t_set(Bdos &bdos, uint16_t arg) {
+  // DAT: day number, hour and minute in BCD
+  uint8_t dat[4];
+  bdos.machine.memout(dat, arg, sizeof(dat));
+  int64_t wanted = (static_cast<int64_t>(dat[0] | dat[1] << 8) - 1) * 86400 +
+                   from_bcd(dat[2]) * 3600 + from_bcd(dat[3]) * 60;
+  CpmTime now = cpm_now(bdos);
+  int64_t current = (static_cast<int64_t>(now.days) - 1) * 86400 +
+                    now.hour * 3600 + now.minute * 60;
+  bdos.clock_offset += wanted - current;
+  return 0;
+}
+
+static uint16_t t_get(Bdos &bdos, uint16_t arg) {
+  CpmTime now = cpm_now(bdos);
+  store_date(bdos, arg, now);
+  // Seconds in A
+  return to_bcd(now.second);
+}
+
+static uint16_t t_seconds(Bdos &bdos, uint16_t arg) {
+  CpmTime now = cpm_now(bdos);
+  store_date(bdos, arg, now);
+  bdos.machine.memory[static_cast<uint16_t>(arg + 4)] = to_bcd(now.second);
+  return 0;
+}
+
+static uint16_t s_serial(Bdos &bdos, uint16_t arg) {
+  static constexpr uint8_t serial[6] = {0, 0, 0, 0, 0, 1};
+  bdos.machine.memin(arg, const_cast<uint8_t *>(serial), sizeof(serial));
+  return 0;
+}
+
+static uint16_t p_code(Bdos &bdos, uint16_t arg) {
+  if (arg == 0xffff) {
+    return bdos.return_code;
+  }
+  bdos.return_code = arg;
+  return 0;
+}
+
+// -- MP/M, single process -------------------------------------------------------
+// A lone process owns every resource, so these mostly succeed immediately.
+
+static uint16_t not_available(Bdos &, uint16_t) { return 0x00ff; }
+
+static uint16_t p_delay(Bdos &, uint16_t arg) {
+  std::this_thread::sleep_for(std::chrono::microseconds(
+      static_cast<int64_t>(arg) * 1'000'000 / MPM_TICKS_PER_SECOND));
+  return 0;
+}
+
+static uint16_t p_cli(Bdos &bdos, uint16_t arg) {
+  // DE points at a length-prefixed command line
+  uint8_t length;
+  char line[256];
+  bdos.machine.memout(&length, arg, 1);
+  bdos.machine.memout(line, static_cast<uint16_t>(arg + 1), length);
+  bdos.chain_command.assign(line, strnlen(line, length));
+  bdos.machine.stop();
+  return 0;
+}
+
+static uint16_t c_set(Bdos &, uint16_t arg) {
+  // Console 0 is the only console
+  return (arg & 0xff) == 0 ? 0x0000 : 0x00ff;
+}
+
+static uint16_t s_sysdat(Bdos &, uint16_t) { return BDOS_SYSDAT; }
+
+static uint16_t p_pdadr(Bdos &, uint16_t) { return BDOS_PD; }
+
+static uint16_t s_osver(Bdos &, uint16_t) { return 0x0130; }
+
+// -- Dispatch -------------------------------------------------------------------
+
+template <BdosProfile P> static uint16_t unsupported(Bdos &bdos, uint16_t) {
+  uint8_t func = bdos.machine.cpu.bc.uint8_array[0];
+  static std::bitset<256> warned;
+  if (!warned[func]) {
+    warned[func] = true;
+    std::cerr << std::format("Warning: unsupported BDOS function {}", func)
+              << std::endl;
+  }
+  return 0x00ff;
+}
+
+template <BdosProfile P> static constexpr BdosTable make_table() {
+  constexpr bool cpm3 = P == BdosProfile::Cpm3;
+  constexpr bool mpm = P == BdosProfile::Mpm;
+
+  BdosTable table{};
+  table.fill(&unsupported<P>);
+
+  table[P_TERMCPM] = &p_termcpm;
+  table[C_READ] = &c_read;
+  table[C_WRITE] = &c_write;
+  table[A_READ] = &a_read;
+  table[A_WRITE] = &a_write;
+  table[L_WRITE] = &l_write;
+  table[C_RAWIO] = &c_rawio<P>;
+  table[A_STATIN] = &a_statin<P>;
+  table[A_STATOUT] = &a_statout<P>;
+  table[C_WRITESTR] = &c_writestr;
+  table[C_READSTR] = &c_readstr;
+  table[C_STAT] = &c_stat;
+  table[S_BDOSVER] = &s_bdosver<P>;
+  table[DRV_ALLRESET] = &drv_allreset;
+  table[DRV_SET] = &drv_set<P>;
+  table[F_OPEN] = &f_open<P>;
+  table[F_CLOSE] = &f_close;
+  table[F_SFIRST] = &f_sfirst;
+  table[F_SNEXT] = &f_snext;
+  table[F_DELETE] = &f_delete<P>;
+  table[F_READ] = &f_read<P>;
+  table[F_WRITE] = &f_write<P>;
+  table[F_MAKE] = &f_make<P>;
+  table[F_RENAME] = &f_rename<P>;
+  table[DRV_LOGINVEC] = &drv_loginvec;
+  table[DRV_GET] = &drv_get;
+  table[F_DMAOFF] = &f_dmaoff;
+  table[DRV_ALLOCVEC] = &drv_allocvec;
+  table[DRV_SETRO] = &drv_setro;
+  table[DRV_ROVEC] = &drv_rovec;
+  table[F_ATTRIB] = &f_attrib<P>;
+  table[DRV_DPB] = &drv_dpb;
+  table[F_USERNUM] = &f_usernum;
+  table[F_READRAND] = &f_readrand<P>;
+  table[F_WRITERAND] = &f_writerand<P>;
+  table[F_SIZE] = &f_size<P>;
+  table[F_RANDREC] = &f_randrec;
+  table[DRV_RESET] = &drv_reset;
+  table[F_WRITEZF] = &f_writerand<P>;
+
+  if constexpr (cpm3 || mpm) {
+    // Drive and record locks always succeed for a single user
+    table[DRV_ACCESS] = &success;
+    table[DRV_FREE] = &success;
+    table[F_TESTWRITE] = &f_writerand<P>;
+    table[F_LOCK] = &success;
+    table[F_UNLOCK] = &success;
+    table[F_MULTISEC] = &f_multisec;
+    table[F_ERRMODE] = &f_errmode;
+    table[DRV_SPACE] = &drv_space<P>;
+    table[P_CHAIN] = &p_chain;
+    table[DRV_FLUSH] = &drv_flush;
+
+    table[F_CLEANUP] = &success;
+    table[F_TRUNCATE] = &f_truncate<P>;
+    table[DRV_SETLABEL] = &success;
+    table[DRV_GETLABEL] = &drv_getlabel;
+    table[F_TIMEDATE] = &f_timedate<P>;
+    table[F_WRITEXFCB] = &success;
+    table[T_SET] = &t_set;
+    table[T_GET] = &t_get;
+    table[F_PASSWD] = &success;
+    table[S_SERIAL] = &s_serial;
+  }
+
+  if constexpr (cpm3) {
+    table[S_SCB] = &s_scb;
+    table[S_BIOS] = &s_bios;
+    table[P_LOAD] = &p_load;
+    table[P_CODE] = &p_code;
+    table[C_MODE] = &c_mode;
+    table[C_DELIMIT] = &c_delimit;
+    table[C_WRITEBLK] = &c_writeblk;
+    table[L_WRITEBLK] = &l_writeblk;
+    table[F_PARSE] = &f_parse;
+
+    // Extensions programs probe for; report them absent without a warning
+    table[Z80_GETSTAMP] = &not_available;
+    table[Z80_USESTAMP] = &not_available;
+    table[RSX_CALL] = &not_available;
+    for (unsigned func = N_LOGIN; func <= N_SERVERCONF; func++) {
+      table[func] = &not_available;
+    }
+  }
+
+  if constexpr (mpm) {
+    table[M_ALLOC_ABS] = &not_available;
+    table[M_ALLOC] = &not_available;
+    table[M_FREE] = &success;
+    table[DEV_POLL] = &success;
+    table[DEV_WAITFLAG] = &not_available;
+    table[DEV_SETFLAG] = &success;
+    for (unsigned func = Q_MAKE; func <= Q_CWRITE; func++) {
+      table[func] = &not_available;
+    }
+    table[P_DELAY] = &p_delay;
+    table[P_DISPATCH] = &success;
+    table[P_TERM] = &p_termcpm;
+    table[P_CREATE] = &not_available;
+    table[P_PRIORITY] = &success;
+    table[C_ATTACH] = &success;
+    table[C_DETACH] = &success;
+    table[C_SET] = &c_set;
+    table[C_ASSIGN] = &success;
+    table[P_CLI] = &p_cli;
+    table[P_RPL] = &not_available;
+    table[F_PARSE] = &f_parse;
+    table[C_GET] = &success;
+    table[S_SYSDAT] = &s_sysdat;
+    table[T_SECONDS] = &t_seconds;
+    table[P_PDADR] = &p_pdadr;
+    table[P_ABORT] = &not_available;
+    table[L_ATTACH] = &success;
+    table[L_DETACH] = &success;
+    table[L_SET] = &c_set;
+    table[L_CATTACH] = &success;
+    table[C_CATTACH] = &success;
+    table[S_OSVER] = &s_osver;
+    table[L_GET] = &success;
+  }
+  return table;
+}
+
+static constexpr BdosTable cpm22_table = make_table<BdosProfile::Cpm22>();
+static constexpr BdosTable cpm3_table = make_table<BdosProfile::Cpm3>();
+static constexpr BdosTable mpm_table = make_table<BdosProfile::Mpm>();
+
+Bdos::Bdos(Machine &machine, BdosProfile profile)
+    : machine(machine), profile(profile) {
+  set_profile(profile);
+}
+
+void Bdos::set_profile(BdosProfile profile) {
+  this->profile = profile;
+  switch (profile) {
+  case BdosProfile::Cpm22:
+    table = cpm22_table;
+    break;
+  case BdosProfile::Cpm3:
+    table = cpm3_table;
+    break;
+  case BdosProfile::Mpm:
+    table = mpm_table;
+    break;
+  }
+}
+
+void Bdos::reset() {
+  open_files.clear();
+  dma_address = 0x0080;
+  multisector_count = 1;
+  delimiter = '$';
+  search_results.clear();
+  search_next = 0;
+
+  uint8_t *memory = machine.memory;
+  std::memset(&memory[BDOS_BASE], 0, 0x10000 - BDOS_BASE);
+
+  // FE00: JP 0005h, for programs that call the address at 0006h directly
+  memory[BDOS_BASE] = 0xC3;
+  memory[BDOS_BASE + 1] = 0x05;
+  memory[BDOS_BASE + 2] = 0x00;
+
+  // Disk parameter block: 64 records per track, 4K blocks (BSH 5, BLM 31,
+  // EXM 1), DSM, DRM, directory in the first blocks, fixed media, no reserved
+  // tracks, and CP/M 3's 128-byte physical sectors (PSH 0, PHM 0)
+  const uint16_t dsm = DISK_BLOCKS - 1;
+  const uint16_t drm = DIRECTORY_ENTRIES - 1;
+  const uint16_t al = static_cast<uint16_t>(0xffff << (16 - DIRECTORY_BLOCKS));
+  const uint8_t dpb[17] = {64,
+                           0,
+                           5,
+                           31,
+                           1,
+                           static_cast<uint8_t>(dsm),
+                           static_cast<uint8_t>(dsm >> 8),
+                           static_cast<uint8_t>(drm),
+                           static_cast<uint8_t>(drm >> 8),
+                           static_cast<uint8_t>(al >> 8),
+                           static_cast<uint8_t>(al),
+                           0x00,
+                           profile == BdosProfile::Cpm3 ? uint8_t(0x80) : uint8_t(0),
+                           0,
+                           0,
+                           0,
+                           0};
+  std::memcpy(&memory[BDOS_DPB], dpb, sizeof(dpb));
+
+  // MP/M process descriptor: name at offset 6
+  std::memcpy(&memory[BDOS_PD + 6], "UCPM    ", 8);
+
+  // Return address for programs that leave with RET (see reset_cpu)
+  memory[BDOS_BASE - 2] = 0x00;
+  memory[BDOS_BASE - 1] = 0x00;
+
+  update_allocation(*this);
+
+  // System Control Block defaults: BDOS version, 80x24 console
+  scb.fill(0);
+  scb[0x05] = 0x31;
+  scb[0x1a] = 79;
+  scb[0x1c] = 24;
+}
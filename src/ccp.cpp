@@ -0,0 +1,376 @@
+#include <algorithm>
+#include <ccp.hpp>
+#include <cctype>
+#include <console.hpp>
+#include <cstring>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <machine.hpp>
+#include <optional>
+#include <system_error>
+
+static std::string to_upper(std::string_view text) {
+  std::string result(text);
+  std::transform(result.begin(), result.end(), result.begin(),
+                 [](unsigned char ch) { return std::toupper(ch); });
+  return result;
+}
+
+static std::string to_lower(std::string_view text) {
+  std::string result(text);
+  std::transform(result.begin(), result.end(), result.begin(),
+                 [](unsigned char ch) { return std::tolower(ch); });
+  return result;
+}
+
+static std::string_view trim(std::string_view text) {
+  size_t start = text.find_first_not_of(" \t");
+  if (start == std::string_view::npos) {
+    return {};
+  }
+  size_t end = text.find_last_not_of(" \t\r\n");
+  return text.substr(start, end - start + 1);
+}
+
+// Split off the first whitespace-delimited word of `text`
+static std::string_view next_word(std::string_view &text) {
+  text = trim(text);
+  size_t end = text.find_first_of(" \t");
+  std::string_view word = text.substr(0, end);
+  text = end == std::string_view::npos ? std::string_view{} : text.substr(end);
+  return word;
+}
+
+// Locate a host file for a CP/M name, trying the name as typed and then its
+// upper and lower case spellings
+static std::optional<std::filesystem::path>
+resolve_file(std::string_view name) {
+  for (const std::string &candidate :
+       {std::string(name), to_upper(name), to_lower(name)}) {
+    std::error_code ec;
+    if (std::filesystem::is_regular_file(candidate, ec)) {
+      return std::filesystem::path(candidate);
+    }
+  }
+  return std::nullopt;
+}
+
+Ccp::Ccp(Machine &machine) : machine(machine) {}
+
+void Ccp::setup_zero_page(std::string_view tail) {
+  // Command tail is stored upper case with its leading blank, as CP/M does
+  machine.set_command_tail(to_upper(tail));
+
+  // 005C: Default FCB 1, 006C: Default FCB 2 (first 16 bytes only, since it
+  // overlaps FCB 1's allocation map)
+  std::string_view rest = tail;
+  uint16_t addresses[2] = {0x005c, 0x006c};
+  for (uint16_t address : addresses) {
+    FileControlBlock fcb;
+    if (!parse_filename(next_word(rest), fcb)) {
+      parse_filename("", fcb);
+    }
+    machine.memin(address, &fcb, 16);
+  }
+  // 007C: Current record of FCB 1, 007D–007F: its random record number
+  std::memset(&machine.memory[0x007c], 0, 4);
+}
+
+bool Ccp::prepare(std::string_view command, bool &ok) {
+  ok = true;
+  std::string_view tail = command;
+  std::string_view word = next_word(tail);
+  if (word.empty()) {
+    return false;
+  }
+  std::string name = to_upper(word);
+
+  if (name.size() == 2 && name[1] == ':') {
+    // Changing drive: only A: exists
+    if (name[0] != 'A') {
+      std::cout << name << "?" << std::endl;
+      ok = false;
+    }
+    return false;
+  }
+  if (name == "DIR") {
+    ok = dir(tail);
+    return false;
+  }
+  if (name == "ERA") {
+    ok = era(tail);
+    return false;
+  }
+  if (name == "REN") {
+    ok = ren(tail);
+    return false;
+  }
+  if (name == "TYPE") {
+    ok = type(tail);
+    return false;
+  }
+
+  std::vector<std::string> args;
+  for (std::string_view rest = tail, arg = next_word(rest); !arg.empty();
+       arg = next_word(rest)) {
+    args.emplace_back(arg);
+  }
+  if (name == "SUBMIT") {
+    if (args.empty()) {
+      std::cout << "SUBMIT?" << std::endl;
+      ok = false;
+      return false;
+    }
+    std::string file = args.front();
+    args.erase(args.begin());
+    std::optional<std::filesystem::path> path = resolve_file(file);
+    if (!path) {
+      path = resolve_file(file + ".SUB");
+    }
+    if (!path) {
+      std::cout << "NO SUB FILE" << std::endl;
+      ok = false;
+      return false;
+    }
+    ok = submit(*path, args);
+    return false;
+  }
+
+  // A host path ("../games/zork1.com") or a CP/M name ("ZORK1")
+  std::optional<std::filesystem::path> program;
+  if (word.find('.') != std::string_view::npos ||
+      word.find('/') != std::string_view::npos) {
+    program = resolve_file(word);
+  } else {
+    program = resolve_file(std::format("{}.COM", word));
+    if (!program) {
+      // CP/M 3 runs a SUBmit file when there is no program by that name
+      if (auto sub = resolve_file(std::format("{}.SUB", word))) {
+        ok = submit(*sub, args);
+        return false;
+      }
+    }
+  }
+  if (program && to_upper(program->extension().string()) == ".SUB") {
+    ok = submit(*program, args);
+    return false;
+  }
+
+  if (!program) {
+    std::cout << name << "?" << std::endl;
+    ok = false;
+    return false;
+  }
+
+  machine.warm_boot();
+  if (!machine.load_program(*program)) {
+    std::cout << "BAD LOAD" << std::endl;
+    ok = false;
+    return false;
+  }
+  setup_zero_page(tail);
+  return true;
+}
+
+bool Ccp::execute(std::string_view line) {
+  // CP/M 3 style command chaining: CMD1 ! CMD2
+  bool ok = true;
+  while (!line.empty()) {
+    size_t bang = line.find('!');
+    std::string_view command = line.substr(0, bang);
+    line = bang == std::string_view::npos ? std::string_view{}
+                                          : line.substr(bang + 1);
+
+    bool command_ok;
+    if (prepare(command, command_ok)) {
+      machine.run();
+      // P_CHAIN leaves the next command line behind in the BDOS
+      std::string chained = std::move(machine.bdos.chain_command);
+      machine.bdos.chain_command.clear();
+      if (!chained.empty()) {
+        command_ok = execute(chained) && command_ok;
+      }
+    }
+    ok = ok && command_ok;
+  }
+  return ok;
+}
+
+bool Ccp::submit(const std::filesystem::path &path,
+                 const std::vector<std::string> &args) {
+  std::ifstream file(path);
+  if (!file) {
+    std::cout << "NO SUB FILE" << std::endl;
+    return false;
+  }
+
+  bool ok = true;
+  std::string line;
+  while (std::getline(file, line)) {
+    // $1..$9 are replaced by the SUBMIT arguments, $$ by a single $
+    std::string expanded;
+    for (size_t i = 0; i < line.size(); i++) {
+      if (line[i] != '$' || i + 1 >= line.size()) {
+        expanded += line[i];
+      } else if (line[i + 1] == '$') {
+        expanded += '$';
+        i++;
+      } else if (line[i + 1] >= '1' && line[i + 1] <= '9') {
+        size_t index = static_cast<size_t>(line[i + 1] - '1');
+        if (index < args.size()) {
+          expanded += args[index];
+        }
+        i++;
+      } else {
+        expanded += line[i];
+      }
+    }
+
+    std::string_view command = trim(expanded);
+    if (command.empty() || command.front() == ';') {
+      continue;
+    }
+    std::cout << "A>" << command << std::endl;
+    ok = execute(command) && ok;
+  }
+  return ok;
+}
+
+void Ccp::interactive() {
+  std::string line;
+  for (;;) {
+    std::cout << "\r\nA>" << std::flush;
+    if (!read_console_line(line, 127)) {
+      std::cout << std::endl;
+      return;
+    }
+    std::cout << "\r\n" << std::flush;
+    execute(line);
+  }
+}
+
+bool Ccp::dir(std::string_view args) {
+  FileControlBlock pattern;
+  std::string_view spec = next_word(args);
+  if (!parse_filename(spec.empty() ? "*.*" : spec, pattern)) {
+    std::cout << "DIR?" << std::endl;
+    return false;
+  }
+
+  std::vector<std::string> files = find_files(pattern);
+  if (files.empty()) {
+    std::cout << "NO FILE" << std::endl;
+    return true;
+  }
+
+  // Four entries per line: "A: NAME     TYP : NAME     TYP ..."
+  for (size_t i = 0; i < files.size(); i++) {
+    FileControlBlock fcb;
+    parse_filename(files[i], fcb);
+    std::cout << (i % 4 == 0 ? "A: " : " : ")
+              << std::string_view(reinterpret_cast<char *>(fcb.f), 8) << ' '
+              << std::string_view(reinterpret_cast<char *>(fcb.t), 3);
+    if (i % 4 == 3 || i + 1 == files.size()) {
+      std::cout << "\r\n";
+    }
+  }
+  std::cout << std::flush;
+  return true;
+}
+
+bool Ccp::era(std::string_view args) {
+  FileControlBlock pattern;
+  std::string_view spec = next_word(args);
+  if (spec.empty() || !parse_filename(spec, pattern)) {
+    std::cout << "ERA?" << std::endl;
+    return false;
+  }
+
+  // ERA *.* asks before emptying the directory, as CP/M's CCP does
+  bool all = std::all_of(std::begin(pattern.f), std::end(pattern.f),
+                         [](uint8_t c) { return c == '?'; }) &&
+             std::all_of(std::begin(pattern.t), std::end(pattern.t),
+                         [](uint8_t c) { return c == '?'; });
+  if (all) {
+    std::cout << "ALL (Y/N)?" << std::flush;
+    std::string answer;
+    bool answered = read_console_line(answer, 127);
+    std::cout << "\r\n" << std::flush;
+    if (!answered || to_upper(trim(answer)) != "Y") {
+      return true;
+    }
+  }
+
+  std::vector<std::string> files = find_files(pattern);
+  if (files.empty()) {
+    std::cout << "NO FILE" << std::endl;
+    return true;
+  }
+  for (const std::string &file : files) {
+    std::remove(file.c_str());
+  }
+  return true;
+}
+
+bool Ccp::ren(std::string_view args) {
+  // REN NEW.TYP=OLD.TYP
+  std::string_view spec = trim(args);
+  size_t equals = spec.find('=');
+  FileControlBlock new_fcb, old_fcb;
+  if (equals == std::string_view::npos ||
+      !parse_filename(trim(spec.substr(0, equals)), new_fcb) ||
+      !parse_filename(trim(spec.substr(equals + 1)), old_fcb)) {
+    std::cout << "REN?" << std::endl;
+    return false;
+  }
+
+  std::vector<std::string> old_files = find_files(old_fcb);
+  if (old_files.size() != 1) {
+    std::cout << "NO FILE" << std::endl;
+    return false;
+  }
+  if (!find_files(new_fcb).empty()) {
+    std::cout << "FILE EXISTS" << std::endl;
+    return false;
+  }
+
+  std::string new_name = to_upper(trim(spec.substr(0, equals)));
+  if (new_name.size() >= 2 && new_name[1] == ':') {
+    new_name.erase(0, 2);
+  }
+  std::error_code ec;
+  std::filesystem::rename(old_files.front(), new_name, ec);
+  if (ec) {
+    std::cout << "REN?" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool Ccp::type(std::string_view args) {
+  FileControlBlock pattern;
+  std::string_view spec = next_word(args);
+  if (spec.empty() || !parse_filename(spec, pattern)) {
+    std::cout << "TYPE?" << std::endl;
+    return false;
+  }
+
+  std::vector<std::string> files = find_files(pattern);
+  std::ifstream file;
+  if (files.size() == 1) {
+    file.open(files.front(), std::ios::binary);
+  }
+  if (!file) {
+    std::cout << "NO FILE" << std::endl;
+    return false;
+  }
+
+  // Text files end at the first ^Z
+  char ch;
+  while (file.get(ch) && ch != 0x1a) {
+    std::cout << ch;
+  }
+  std::cout << std::flush;
+  return true;
+}
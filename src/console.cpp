@@ -0,0 +1,47 @@
+#include <console.hpp>
+#include <iostream>
+#include <sys/select.h>
+#include <unistd.h>
+
+bool console_has_char() {
+  fd_set set;
+  struct timeval tv = {0, 0};
+  FD_ZERO(&set);
+  FD_SET(STDIN_FILENO, &set);
+
+  return select(STDIN_FILENO + 1, &set, nullptr, nullptr, &tv) > 0;
+}
+
+int read_console_char() {
+  unsigned char ch;
+  if (read(STDIN_FILENO, &ch, 1) != 1) {
+    return -1;
+  }
+  return ch;
+}
+
+bool read_console_line(std::string &line, size_t max) {
+  line.clear();
+
+  // Simple line editor: echo, handle BS/DEL, stop on CR/LF
+  while (line.size() < max) {
+    char ch;
+    if (read(STDIN_FILENO, &ch, 1) != 1) {
+      // End of input: hand back whatever was typed so far
+      return !line.empty();
+    }
+    if (ch == '\r' || ch == '\n') {
+      break;
+    }
+    if (ch == '\b' || static_cast<unsigned char>(ch) == 0x7f) {
+      if (!line.empty()) {
+        line.pop_back();
+        std::cout << "\b \b" << std::flush;
+      }
+      continue;
+    }
+    line.push_back(ch);
+    std::cout << ch << std::flush;
+  }
+  return true;
+}
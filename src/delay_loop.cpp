@@ -0,0 +1,158 @@
+#include <Z80.h>
+#include <cstdint>
+#include <delay_loop.hpp>
+#include <machine.hpp>
+
+// Recognised loop shapes. Each loop's counter lives in a register and the
+// loop body touches nothing but that counter (and A/F for 16-bit counters),
+// so skipping iterations only has to update the counter, the cycle count,
+// R and MEMPTR.
+//
+//   DJNZ $                          10 FE
+//   DEC r / JR NZ,$-1               xx 20 FD
+//   DEC r / JP NZ,loop              xx C2 lo hi
+//   DEC rr / LD A,hi / OR lo / JR NZ  xx yy zz 20 FB  (either byte order)
+//   DEC rr / LD A,hi / OR lo / JP NZ  xx yy zz C2 lo hi
+
+namespace {
+
+struct Iteration {
+  // T-states of one taken iteration
+  unsigned cycles;
+  // Opcode fetches (M1 cycles) per iteration, for the R register
+  unsigned fetches;
+};
+
+uint8_t *dec8_register(Z80 &cpu, uint8_t opcode) {
+  switch (opcode) {
+  case 0x05:
+    return &cpu.bc.uint8_array[1];
+  case 0x0d:
+    return &cpu.bc.uint8_array[0];
+  case 0x15:
+    return &cpu.de.uint8_array[1];
+  case 0x1d:
+    return &cpu.de.uint8_array[0];
+  case 0x25:
+    return &cpu.hl.uint8_array[1];
+  case 0x2d:
+    return &cpu.hl.uint8_array[0];
+  case 0x3d:
+    return &cpu.af.uint8_array[1];
+  default:
+    return nullptr;
+  }
+}
+
+ZInt16 *dec16_register(Z80 &cpu, uint8_t opcode) {
+  switch (opcode) {
+  case 0x0b:
+    return &cpu.bc;
+  case 0x1b:
+    return &cpu.de;
+  case 0x2b:
+    return &cpu.hl;
+  default:
+    return nullptr;
+  }
+}
+
+// Matches a conditional jump back to `target` at `address`, returning the
+// cost of one taken iteration of it.
+bool match_jump_back(const Machine &machine, uint16_t address, uint16_t target,
+                     Iteration &jump) {
+  const uint8_t *memory = machine.memory;
+  if (memory[address] == 0x20) {
+    // JR NZ,e: displacement is relative to the following instruction
+    int8_t displacement = static_cast<int8_t>(memory[uint16_t(address + 1)]);
+    if (uint16_t(address + 2 + displacement) == target) {
+      jump = {12, 1};
+      return true;
+    }
+  } else if (memory[address] == 0xc2) {
+    // JP NZ,nn
+    uint16_t nn = memory[uint16_t(address + 1)] |
+                  (memory[uint16_t(address + 2)] << 8);
+    if (nn == target) {
+      jump = {10, 1};
+      return true;
+    }
+  }
+  return false;
+}
+
+void skip(Machine &machine, uint16_t address, Iteration iteration,
+          unsigned count) {
+  machine.cpu.cycles += static_cast<zusize>(iteration.cycles) * count;
+  machine.cpu.r += static_cast<uint8_t>(iteration.fetches * count);
+  // The last taken jump leaves MEMPTR pointing at the loop head
+  machine.cpu.memptr.uint16_value = address;
+}
+
+} // namespace
+
+bool fast_forward_delay_loop(Machine &machine, uint16_t address) {
+  Z80 &cpu = machine.cpu;
+  // Opcode fetches after a CB, DD, ED or FD prefix are not at PC. The byte
+  // there is part of another instruction (RL B, DEC IXH, ...), not a loop.
+  if (address != cpu.pc.uint16_value) {
+    return false;
+  }
+  const uint8_t *memory = machine.memory;
+  uint8_t opcode = memory[address];
+
+  if (opcode == 0x10) {
+    // DJNZ $
+    if (memory[uint16_t(address + 1)] != 0xfe) {
+      return false;
+    }
+    uint8_t &b = cpu.bc.uint8_array[1];
+    unsigned iterations = b ? b : 256;
+    if (iterations < 2) {
+      return false;
+    }
+    skip(machine, address, {13, 1}, iterations - 1);
+    b = 1;
+    return true;
+  }
+
+  if (uint8_t *counter = dec8_register(cpu, opcode)) {
+    Iteration jump;
+    if (!match_jump_back(machine, uint16_t(address + 1), address, jump)) {
+      return false;
+    }
+    unsigned iterations = *counter ? *counter : 256;
+    if (iterations < 2) {
+      return false;
+    }
+    skip(machine, address, {4 + jump.cycles, 1 + jump.fetches},
+         iterations - 1);
+    *counter = 1;
+    return true;
+  }
+
+  if (ZInt16 *counter = dec16_register(cpu, opcode)) {
+    // LD A,hi / OR lo, or LD A,lo / OR hi, for the pair being counted
+    uint8_t hi = opcode == 0x0b ? 0 : opcode == 0x1b ? 2 : 4;
+    uint8_t lo = hi + 1;
+    uint8_t load = memory[uint16_t(address + 1)];
+    uint8_t test = memory[uint16_t(address + 2)];
+    bool matches = (load == 0x78 + hi && test == 0xb0 + lo) ||
+                   (load == 0x78 + lo && test == 0xb0 + hi);
+    Iteration jump;
+    if (!matches ||
+        !match_jump_back(machine, uint16_t(address + 3), address, jump)) {
+      return false;
+    }
+    unsigned iterations = counter->uint16_value ? counter->uint16_value : 65536;
+    if (iterations < 2) {
+      return false;
+    }
+    skip(machine, address, {6 + 4 + 4 + jump.cycles, 3 + jump.fetches},
+         iterations - 1);
+    counter->uint16_value = 1;
+    return true;
+  }
+
+  return false;
+}
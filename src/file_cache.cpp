@@ -0,0 +1,141 @@
+#include <fcntl.h>
+#include <file_cache.hpp>
+#include <format>
+#include <sys/stat.h>
+#include <unistd.h>
+
+CachedFile::CachedFile(FileId id, std::vector<uint8_t> contents,
+                       timespec mtime)
+    : file(id), bytes(std::move(contents)), mtime(mtime) {}
+
+FileId file_id(const std::filesystem::path &path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) < 0) {
+    return {};
+  }
+  return {st.st_dev, st.st_ino};
+}
+
+FileCache &FileCache::instance() {
+  static FileCache cache;
+  return cache;
+}
+
+std::shared_ptr<const CachedFile>
+FileCache::open(const std::filesystem::path &path) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return nullptr;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    close(fd);
+    return nullptr;
+  }
+
+  std::lock_guard lock(mutex);
+  FileId id{st.st_dev, st.st_ino};
+  auto it = files.find(id);
+  if (it != files.end()) {
+    std::shared_ptr<const CachedFile> cached = it->second.lock();
+    if (cached && cached->size() == static_cast<size_t>(st.st_size) &&
+        cached->modified().tv_sec == st.st_mtim.tv_sec &&
+        cached->modified().tv_nsec == st.st_mtim.tv_nsec) {
+      close(fd);
+      counters.hits++;
+      return cached;
+    }
+    // Changed on the host since it was read, or no longer read by anyone
+    drop(id);
+  }
+
+  std::vector<uint8_t> contents(static_cast<size_t>(st.st_size));
+  size_t got = 0;
+  while (got < contents.size()) {
+    ssize_t n = read(fd, contents.data() + got, contents.size() - got);
+    if (n < 0) {
+      close(fd);
+      return nullptr;
+    }
+    if (n == 0) {
+      // Truncated while being read
+      break;
+    }
+    got += static_cast<size_t>(n);
+  }
+  close(fd);
+  if (got == 0) {
+    return nullptr;
+  }
+  contents.resize(got);
+
+  counters.misses++;
+  auto cached =
+      std::make_shared<const CachedFile>(id, std::move(contents), st.st_mtim);
+  std::erase_if(files, [](const auto &entry) { return entry.second.expired(); });
+  files[id] = cached;
+  return cached;
+}
+
+void FileCache::invalidate(const std::filesystem::path &path) {
+  {
+    std::lock_guard lock(mutex);
+    if (files.empty()) {
+      return;
+    }
+  }
+  invalidate(file_id(path));
+}
+
+void FileCache::invalidate(FileId id) {
+  std::lock_guard lock(mutex);
+  drop(id);
+}
+
+bool FileCache::current(const CachedFile &file) const {
+  std::lock_guard lock(mutex);
+  auto it = files.find(file.id());
+  return it != files.end() && it->second.lock().get() == &file;
+}
+
+bool FileCache::changed_on_host(const CachedFile &file,
+                                const std::filesystem::path &path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) < 0) {
+    return true;
+  }
+  return FileId{st.st_dev, st.st_ino} != file.id() ||
+         static_cast<size_t>(st.st_size) != file.size() ||
+         st.st_mtim.tv_sec != file.modified().tv_sec ||
+         st.st_mtim.tv_nsec != file.modified().tv_nsec;
+}
+
+void FileCache::drop(FileId id) {
+  auto it = files.find(id);
+  if (it == files.end()) {
+    return;
+  }
+  bool held = !it->second.expired();
+  files.erase(it);
+  if (held) {
+    counters.invalidations++;
+    // Handles still holding the old copy stop using it at their next read
+    current_generation++;
+  }
+}
+
+FileCache::Stats FileCache::stats() const {
+  std::lock_guard lock(mutex);
+  Stats stats = counters;
+  stats.records = records;
+  return stats;
+}
+
+void FileCache::report(std::ostream &out) const {
+  Stats s = stats();
+  out << std::format("File cache:        {} hits, {} misses, {} invalidated, "
+                     "{} records served\n",
+                     s.hits, s.misses, s.invalidations, s.records);
+  out.flush();
+}
@@ -0,0 +1,630 @@
+#include <Z80.h>
+#include <algorithm>
+#include <arpa/inet.h>
+#include <charconv>
+#include <format>
+#include <gdb_stub.hpp>
+#include <iostream>
+#include <machine.hpp>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Registers in the order of gdb's z80 target description
+enum Register {
+  REG_AF,
+  REG_BC,
+  REG_DE,
+  REG_HL,
+  REG_SP,
+  REG_PC,
+  REG_IX,
+  REG_IY,
+  REG_AF_,
+  REG_BC_,
+  REG_DE_,
+  REG_HL_,
+  REG_IR,
+  REG_COUNT
+};
+
+static bool parse_hex(std::string_view text, uint32_t &value) {
+  auto [end, ec] =
+      std::from_chars(text.data(), text.data() + text.size(), value, 16);
+  return ec == std::errc() && end == text.data() + text.size();
+}
+
+static std::string to_hex(const uint8_t *data, size_t size) {
+  std::string hex;
+  for (size_t i = 0; i < size; i++) {
+    hex += std::format("{:02x}", data[i]);
+  }
+  return hex;
+}
+
+// Split "addr,length" (optionally followed by ":data") into its fields
+static bool parse_range(std::string_view text, uint32_t &address,
+                        uint32_t &length) {
+  size_t comma = text.find(',');
+  if (comma == std::string_view::npos) {
+    return false;
+  }
+  return parse_hex(text.substr(0, comma), address) &&
+         parse_hex(text.substr(comma + 1), length);
+}
+
+GdbStub::GdbStub(Machine &machine) : machine(machine) {}
+
+GdbStub::~GdbStub() {
+  if (connection >= 0) {
+    if (resumed) {
+      // Session over: report the target exited
+      send_packet("W00");
+    }
+    detach();
+  }
+  if (!unix_path.empty()) {
+    unlink(unix_path.c_str());
+  }
+}
+
+bool GdbStub::listen(std::string_view address) {
+  int server;
+  if (address.find('/') != std::string_view::npos) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (address.size() >= sizeof(addr.sun_path)) {
+      std::cerr << "Error: Socket path too long: " << address << std::endl;
+      return false;
+    }
+    std::copy(address.begin(), address.end(), addr.sun_path);
+    unix_path = address;
+    unlink(unix_path.c_str());
+
+    server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0 ||
+        bind(server, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+      std::cerr << "Error: Cannot listen on " << address << std::endl;
+      if (server >= 0) {
+        close(server);
+      }
+      return false;
+    }
+  } else {
+    // Only ever listen on loopback: the stub gives full control of the guest
+    size_t colon = address.rfind(':');
+    std::string_view port_text =
+        colon == std::string_view::npos ? address : address.substr(colon + 1);
+    uint16_t port = 0;
+    auto [end, ec] = std::from_chars(
+        port_text.data(), port_text.data() + port_text.size(), port);
+    if (ec != std::errc() || end != port_text.data() + port_text.size()) {
+      std::cerr << "Error: Invalid gdb port: " << address << std::endl;
+      return false;
+    }
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    server = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    if (server >= 0) {
+      setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    }
+    if (server < 0 ||
+        bind(server, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+      std::cerr << "Error: Cannot listen on port " << port << std::endl;
+      if (server >= 0) {
+        close(server);
+      }
+      return false;
+    }
+  }
+
+  if (::listen(server, 1) < 0) {
+    close(server);
+    return false;
+  }
+  std::cerr << "Waiting for gdb on " << address << std::endl;
+  connection = accept(server, nullptr, nullptr);
+  close(server);
+  if (connection < 0) {
+    return false;
+  }
+
+  machine.debugger = this;
+  return true;
+}
+
+int GdbStub::read_byte(bool block) {
+  if (input.empty()) {
+    uint8_t buffer[256];
+    ssize_t got = recv(connection, buffer, sizeof(buffer),
+                       block ? 0 : MSG_DONTWAIT);
+    if (got <= 0) {
+      return -1;
+    }
+    input.assign(buffer, buffer + got);
+    std::reverse(input.begin(), input.end());
+  }
+  uint8_t byte = input.back();
+  input.pop_back();
+  return byte;
+}
+
+bool GdbStub::interrupt_requested() {
+  // gdb sends a bare ^C outside of any packet to interrupt the target
+  int byte;
+  while ((byte = read_byte(false)) >= 0) {
+    if (byte == 0x03) {
+      return true;
+    }
+  }
+  return false;
+}
+
+std::optional<std::string> GdbStub::receive_packet() {
+  for (;;) {
+    int byte = read_byte(true);
+    if (byte < 0) {
+      return std::nullopt;
+    }
+    if (byte != '$') {
+      // Acks, and ^C while already stopped
+      continue;
+    }
+
+    std::string packet;
+    uint8_t sum = 0;
+    while ((byte = read_byte(true)) >= 0 && byte != '#') {
+      packet += static_cast<char>(byte);
+      sum += static_cast<uint8_t>(byte);
+    }
+    int high = read_byte(true);
+    int low = read_byte(true);
+    if (byte < 0 || high < 0 || low < 0) {
+      return std::nullopt;
+    }
+
+    uint32_t checksum;
+    const char digits[2] = {static_cast<char>(high), static_cast<char>(low)};
+    if (!parse_hex(std::string_view(digits, 2), checksum) || checksum != sum) {
+      send(connection, "-", 1, MSG_NOSIGNAL);
+      continue;
+    }
+    send(connection, "+", 1, MSG_NOSIGNAL);
+    return packet;
+  }
+}
+
+void GdbStub::send_packet(std::string_view data) {
+  uint8_t sum = 0;
+  for (char ch : data) {
+    sum += static_cast<uint8_t>(ch);
+  }
+  std::string packet = std::format("${}#{:02x}", data, sum);
+
+  // Resend until gdb acknowledges it
+  for (;;) {
+    send(connection, packet.data(), packet.size(), MSG_NOSIGNAL);
+    int ack;
+    do {
+      ack = read_byte(true);
+    } while (ack >= 0 && ack != '+' && ack != '-');
+    if (ack != '-') {
+      return;
+    }
+  }
+}
+
+GdbStub::Resume GdbStub::serve(std::string_view stop_reply) {
+  if (resumed) {
+    send_packet(stop_reply);
+    resumed = false;
+  }
+
+  for (;;) {
+    std::optional<std::string> packet = receive_packet();
+    if (!packet) {
+      // gdb went away: let the program carry on undisturbed
+      detach();
+      return Resume::Continue;
+    }
+    if (packet->empty()) {
+      // Unsupported, like any other unknown packet
+      send_packet("");
+      continue;
+    }
+
+    switch ((*packet)[0]) {
+    case 'c':
+    case 's': {
+      uint32_t address;
+      if (packet->size() > 1 && parse_hex(packet->substr(1), address)) {
+        write_register(REG_PC, static_cast<uint16_t>(address));
+      }
+      resumed = true;
+      return (*packet)[0] == 'c' ? Resume::Continue : Resume::Step;
+    }
+    case 'k':
+      detach();
+      return Resume::Kill;
+    case 'D':
+      send_packet("OK");
+      detach();
+      return Resume::Continue;
+    case '?':
+      send_packet(stop_reply);
+      break;
+    default:
+      if (std::optional<std::string> reply = handle(*packet)) {
+        send_packet(*reply);
+      }
+      break;
+    }
+  }
+}
+
+std::optional<std::string> GdbStub::handle(std::string_view packet) {
+  char command = packet[0];
+  std::string_view args = packet.substr(1);
+
+  switch (command) {
+  case 'g':
+    return read_registers();
+  case 'G': {
+    if (args.size() < REG_COUNT * 4) {
+      return "E01";
+    }
+    for (unsigned i = 0; i < REG_COUNT; i++) {
+      uint32_t low, high;
+      if (!parse_hex(args.substr(i * 4, 2), low) ||
+          !parse_hex(args.substr(i * 4 + 2, 2), high)) {
+        return "E01";
+      }
+      write_register(i, static_cast<uint16_t>(low | high << 8));
+    }
+    return "OK";
+  }
+  case 'p': {
+    uint32_t index;
+    if (!parse_hex(args, index) || index >= REG_COUNT) {
+      return "E01";
+    }
+    return read_registers().substr(index * 4, 4);
+  }
+  case 'P': {
+    size_t equals = args.find('=');
+    uint32_t index, low, high;
+    if (equals == std::string_view::npos || args.size() < equals + 5 ||
+        !parse_hex(args.substr(0, equals), index) || index >= REG_COUNT ||
+        !parse_hex(args.substr(equals + 1, 2), low) ||
+        !parse_hex(args.substr(equals + 3, 2), high)) {
+      return "E01";
+    }
+    write_register(index, static_cast<uint16_t>(low | high << 8));
+    return "OK";
+  }
+  case 'm': {
+    uint32_t address, length;
+    if (!parse_range(args, address, length)) {
+      return "E01";
+    }
+    std::string hex;
+    for (uint32_t i = 0; i < length && i < 0x10000; i++) {
+      uint8_t byte = machine.peek(static_cast<uint16_t>(address + i));
+      hex += to_hex(&byte, 1);
+    }
+    return hex;
+  }
+  case 'M': {
+    size_t colon = args.find(':');
+    uint32_t address, length;
+    if (colon == std::string_view::npos ||
+        !parse_range(args.substr(0, colon), address, length) ||
+        args.size() - colon - 1 < length * 2) {
+      return "E01";
+    }
+    std::string_view data = args.substr(colon + 1);
+    for (uint32_t i = 0; i < length; i++) {
+      uint32_t byte;
+      if (!parse_hex(data.substr(i * 2, 2), byte)) {
+        return "E01";
+      }
+      machine.poke(static_cast<uint16_t>(address + i),
+                   static_cast<uint8_t>(byte));
+    }
+    return "OK";
+  }
+  case 'Z':
+  case 'z': {
+    // Z0/Z1: software/hardware breakpoint, Z2: write watchpoint
+    if (args.size() < 2 || args[1] != ',') {
+      return "";
+    }
+    char type = args[0];
+    uint32_t address, length;
+    if (!parse_range(args.substr(2), address, length)) {
+      return "E01";
+    }
+    if (type == '0' || type == '1') {
+      if (command == 'z') {
+        remove_breakpoint(static_cast<uint16_t>(address));
+        return "OK";
+      }
+      return insert_breakpoint(static_cast<uint16_t>(address)) ? "OK"
+                                                               : "E01";
+    }
+    if (type == '2') {
+      Watchpoint watch{static_cast<uint16_t>(address),
+                       static_cast<uint16_t>(std::max<uint32_t>(length, 1))};
+      if (command == 'Z') {
+        watchpoints.push_back(watch);
+      } else {
+        std::erase_if(watchpoints, [&](const Watchpoint &w) {
+          return w.address == watch.address && w.length == watch.length;
+        });
+      }
+      update_write_protect();
+      return "OK";
+    }
+    // Read and access watchpoints are not supported
+    return "";
+  }
+  case 'H':
+    return "OK";
+  case 'q':
+    if (args.starts_with("Supported")) {
+      return "PacketSize=1000;swbreak+;hwbreak+";
+    }
+    if (args == "Attached") {
+      return "1";
+    }
+    if (args == "C") {
+      return "QC1";
+    }
+    if (args == "fThreadInfo") {
+      return "m1";
+    }
+    if (args == "sThreadInfo") {
+      return "l";
+    }
+    return "";
+  case 'T':
+    return "OK";
+  default:
+    // Unsupported packets get an empty reply
+    return "";
+  }
+}
+
+void GdbStub::program_started() {
+  if (connection < 0 || started) {
+    return;
+  }
+  // Stop before the first instruction of the first program
+  started = true;
+  stop_between_instructions("S05");
+}
+
+void GdbStub::slice_finished() {
+  if (connection < 0) {
+    return;
+  }
+  if (step_pending) {
+    step_pending = false;
+    stop_between_instructions("S05");
+  } else if (watch_hit) {
+    std::string reply = std::format("T05watch:{:04x};", *watch_hit);
+    watch_hit.reset();
+    stop_between_instructions(reply);
+  } else if (interrupt_requested()) {
+    stop_between_instructions("S02");
+  }
+}
+
+void GdbStub::stop_between_instructions(std::string stop_reply) {
+  for (;;) {
+    Resume resume = serve(stop_reply);
+    if (resume == Resume::Kill) {
+      machine.stop();
+      return;
+    }
+
+    // Resuming onto a breakpoint must execute it, not report it again
+    uint16_t pc = machine.cpu.pc.uint16_value;
+    if (std::find(breakpoints.begin(), breakpoints.end(), pc) !=
+        breakpoints.end()) {
+      skip_breakpoint = pc;
+    }
+    if (resume == Resume::Continue || connection < 0) {
+      return;
+    }
+
+    // Single step right here, then report the new stop
+    machine.cycles += z80_execute(&machine.cpu, 1);
+    skip_breakpoint.reset();
+    if (!machine.running) {
+      return;
+    }
+    stop_reply = "S05";
+    if (watch_hit) {
+      stop_reply = std::format("T05watch:{:04x};", *watch_hit);
+      watch_hit.reset();
+    }
+  }
+}
+
+uint8_t GdbStub::breakpoint_hit(uint16_t address) {
+  if (skip_breakpoint == address || connection < 0) {
+    skip_breakpoint.reset();
+    return machine.peek(address);
+  }
+
+  Resume resume = serve("T05swbreak:;");
+  if (resume == Resume::Kill) {
+    machine.stop();
+    return 0x00; // NOP
+  }
+
+  if (machine.cpu.pc.uint16_value != address) {
+    // gdb moved PC while we were part way through fetching the opcode.
+    // Execute a NOP from the byte before the new PC so the fetch lands there.
+    machine.cpu.pc.uint16_value--;
+    if (resume == Resume::Step) {
+      step_pending = true;
+      z80_break(&machine.cpu);
+    }
+    return 0x00; // NOP
+  }
+
+  if (resume == Resume::Step) {
+    // Let this one instruction run, then stop again
+    step_pending = true;
+    z80_break(&machine.cpu);
+  }
+  return machine.peek(address);
+}
+
+void GdbStub::protected_write(uint16_t address) {
+  for (const Watchpoint &watch : watchpoints) {
+    if (static_cast<uint16_t>(address - watch.address) < watch.length) {
+      watch_hit = address;
+      // Report once the writing instruction has finished
+      z80_break(&machine.cpu);
+      return;
+    }
+  }
+}
+
+void GdbStub::update_write_protect() {
+  std::bitset<256> pages;
+  for (const Watchpoint &watch : watchpoints) {
+    for (uint32_t i = 0; i < watch.length; i += 1) {
+      pages[static_cast<uint16_t>(watch.address + i) >> 8] = true;
+    }
+  }
+  machine.set_write_protect(this, pages, [this](Machine &, uint16_t address) {
+    protected_write(address);
+  });
+}
+
+bool GdbStub::insert_breakpoint(uint16_t address) {
+  if (std::find(breakpoints.begin(), breakpoints.end(), address) !=
+      breakpoints.end()) {
+    return true;
+  }
+  if (!machine.set_trap(address, [this](Machine &, uint16_t address) {
+        return breakpoint_hit(address);
+      })) {
+    // Something else already traps this instruction
+    return false;
+  }
+  breakpoints.push_back(address);
+  return true;
+}
+
+void GdbStub::remove_breakpoint(uint16_t address) {
+  auto it = std::find(breakpoints.begin(), breakpoints.end(), address);
+  if (it == breakpoints.end()) {
+    return;
+  }
+  machine.clear_trap(address);
+  breakpoints.erase(it);
+}
+
+void GdbStub::detach() {
+  // Undo every patch so the machine is back on its undisturbed fast path
+  while (!breakpoints.empty()) {
+    remove_breakpoint(breakpoints.back());
+  }
+  watchpoints.clear();
+  update_write_protect();
+  machine.debugger = nullptr;
+  step_pending = false;
+  watch_hit.reset();
+  resumed = false;
+
+  if (connection >= 0) {
+    close(connection);
+    connection = -1;
+  }
+}
+
+std::string GdbStub::read_registers() const {
+  const Z80 &cpu = machine.cpu;
+  uint16_t values[REG_COUNT] = {
+      cpu.af.uint16_value,
+      cpu.bc.uint16_value,
+      cpu.de.uint16_value,
+      cpu.hl.uint16_value,
+      cpu.sp.uint16_value,
+      cpu.pc.uint16_value,
+      cpu.ix_iy[0].uint16_value,
+      cpu.ix_iy[1].uint16_value,
+      cpu.af_.uint16_value,
+      cpu.bc_.uint16_value,
+      cpu.de_.uint16_value,
+      cpu.hl_.uint16_value,
+      static_cast<uint16_t>(cpu.i << 8 | (cpu.r & 0x7f) | (cpu.r7 & 0x80)),
+  };
+
+  std::string hex;
+  for (uint16_t value : values) {
+    uint8_t bytes[2] = {static_cast<uint8_t>(value),
+                        static_cast<uint8_t>(value >> 8)};
+    hex += to_hex(bytes, 2);
+  }
+  return hex;
+}
+
+void GdbStub::write_register(unsigned index, uint16_t value) {
+  Z80 &cpu = machine.cpu;
+  switch (index) {
+  case REG_AF:
+    cpu.af.uint16_value = value;
+    break;
+  case REG_BC:
+    cpu.bc.uint16_value = value;
+    break;
+  case REG_DE:
+    cpu.de.uint16_value = value;
+    break;
+  case REG_HL:
+    cpu.hl.uint16_value = value;
+    break;
+  case REG_SP:
+    cpu.sp.uint16_value = value;
+    break;
+  case REG_PC:
+    cpu.pc.uint16_value = value;
+    break;
+  case REG_IX:
+    cpu.ix_iy[0].uint16_value = value;
+    break;
+  case REG_IY:
+    cpu.ix_iy[1].uint16_value = value;
+    break;
+  case REG_AF_:
+    cpu.af_.uint16_value = value;
+    break;
+  case REG_BC_:
+    cpu.bc_.uint16_value = value;
+    break;
+  case REG_DE_:
+    cpu.de_.uint16_value = value;
+    break;
+  case REG_HL_:
+    cpu.hl_.uint16_value = value;
+    break;
+  case REG_IR:
+    cpu.i = static_cast<uint8_t>(value >> 8);
+    cpu.r = static_cast<uint8_t>(value);
+    cpu.r7 = static_cast<uint8_t>(value);
+    break;
+  }
+}
@@ -0,0 +1,92 @@
+#include <cerrno>
+#include <format>
+#include <governor.hpp>
+
+// How far behind schedule emulation may fall (e.g. while blocked on console
+// input) before the schedule is restarted instead of running flat out to
+// catch up
+static constexpr int64_t max_lag_ns = 50'000'000;
+
+// Slice length when unthrottled; long enough to amortise the loop overhead
+static constexpr zusize unthrottled_slice = 1 << 16;
+
+static int64_t to_ns(const timespec &ts) {
+  return static_cast<int64_t>(ts.tv_sec) * 1'000'000'000 + ts.tv_nsec;
+}
+
+static timespec from_ns(int64_t ns) {
+  return {static_cast<time_t>(ns / 1'000'000'000),
+          static_cast<long>(ns % 1'000'000'000)};
+}
+
+static timespec now(clockid_t clock) {
+  timespec ts;
+  clock_gettime(clock, &ts);
+  return ts;
+}
+
+ClockGovernor::ClockGovernor(uint64_t hz)
+    : clock_hz(hz),
+      // Millisecond slices: fine enough for smooth pacing, coarse enough
+      // that the sleeps themselves cost next to nothing
+      slice_cycles(hz ? static_cast<zusize>(hz / 1000 ? hz / 1000 : 1)
+                      : unthrottled_slice) {}
+
+void ClockGovernor::rebase(const timespec &now, uint64_t cycles) {
+  epoch = now;
+  epoch_cycles = cycles;
+  started = true;
+}
+
+void ClockGovernor::pace(uint64_t cycles) {
+  if (!clock_hz) {
+    return;
+  }
+
+  timespec current = now(CLOCK_MONOTONIC);
+  if (!started) {
+    rebase(current, cycles);
+    return;
+  }
+
+  uint64_t elapsed = cycles - epoch_cycles;
+  int64_t target = to_ns(epoch) +
+                   static_cast<int64_t>(elapsed / clock_hz * 1'000'000'000 +
+                                        elapsed % clock_hz * 1'000'000'000 /
+                                            clock_hz);
+  int64_t lag = to_ns(current) - target;
+  if (lag > max_lag_ns) {
+    rebase(current, cycles);
+    return;
+  }
+  if (lag >= 0) {
+    return;
+  }
+
+  // Absolute deadline, so oversleeping on one slice is made up on the next
+  timespec deadline = from_ns(target);
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, nullptr) ==
+         EINTR) {
+  }
+}
+
+SessionStats::SessionStats()
+    : wall_start(now(CLOCK_MONOTONIC)),
+      cpu_start(now(CLOCK_PROCESS_CPUTIME_ID)) {}
+
+void SessionStats::report(std::ostream &out, uint64_t cycles,
+                          uint64_t hz) const {
+  double wall = (to_ns(now(CLOCK_MONOTONIC)) - to_ns(wall_start)) / 1e9;
+  double cpu = (to_ns(now(CLOCK_PROCESS_CPUTIME_ID)) - to_ns(cpu_start)) / 1e9;
+
+  out << std::format("Emulated T-states: {}\n", cycles);
+  if (hz) {
+    out << std::format("Target clock:      {:.3f} MHz\n", hz / 1e6);
+  }
+  out << std::format("Effective clock:   {:.3f} MHz\n",
+                     wall > 0 ? cycles / wall / 1e6 : 0.0);
+  out << std::format("Wall time:         {:.3f} s\n", wall);
+  out << std::format("Host CPU time:     {:.3f} s ({:.1f}% of one core)\n", cpu,
+                     wall > 0 ? cpu / wall * 100 : 0.0);
+  out.flush();
+}
@@ -2,390 +2,54 @@
 #include <bdos.hpp>
 #include <cstdint>
 #include <cstring>
-#include <format>
+#include <delay_loop.hpp>
+#include <gdb_stub.hpp>
 #include <fstream>
-#include <iostream>
 #include <machine.hpp>
 #include <string>
-#include <termios.h>
-#include <unistd.h>
-#include <unordered_map>
+#include <string_view>
 
-static std::unordered_map<std::string, std::fstream> open_files;
-
-static std::string get_filename_from_fcb(const FileControlBlock &fcb) {
-  std::string name = std::format("{:.8}", (char *)fcb.f);
-  std::string type = std::format("{:.3}", (char *)fcb.t);
-
-  name.erase(name.find_last_not_of(' ') + 1);
-  type.erase(type.find_last_not_of(' ') + 1);
-
-  return std::format("{}.{}", name, type);
+static zuint8 read_memory(void *ctx, zuint16 address) {
+  return static_cast<Machine *>(ctx)->memory[address];
 }
 
-static bool console_has_char() {
-  fd_set set;
-  struct timeval tv = {0, 0};
-  FD_ZERO(&set);
-  FD_SET(STDIN_FILENO, &set);
-
-  return select(STDIN_FILENO + 1, &set, nullptr, nullptr, &tv) > 0;
+// Installed instead of read_memory only while traps are set, so the program
+// reads the bytes they replaced rather than TRAP_OPCODE
+static zuint8 read_memory_trapped(void *context, zuint16 address) {
+  return static_cast<Machine *>(context)->peek(address);
 }
 
-static zuint8 read_memory(void *ctx, zuint16 address) {
-  return static_cast<Machine *>(ctx)->memory[address];
+static void install_read(Machine &machine) {
+  zuint8 (*read)(void *, zuint16) =
+      machine.traps.empty() ? read_memory : read_memory_trapped;
+  machine.cpu.fetch = read;
+  machine.cpu.read = read;
 }
 
 static void write_memory(void *context, zuint16 address, zuint8 value) {
   static_cast<Machine *>(context)->memory[address] = value;
 }
 
+// Installed instead of write_memory only while some page is write protected
+static void write_memory_checked(void *context, zuint16 address,
+                                 zuint8 value) {
+  Machine &machine = *static_cast<Machine *>(context);
+  machine.memory[address] = value;
+  if (machine.write_protected[address >> 8]) {
+    machine.protected_write(address);
+  }
+}
+
 static zuint8 fetch_opcode(void *context, zuint16 address) {
   Machine &machine = *static_cast<Machine *>(context);
 
   if (!address) {
-    machine.running = false;
+    machine.stop();
     return 0x00; // NOP
   } else if (address == 5) {
     uint8_t func = machine.cpu.bc.uint8_array[0];
     uint16_t arg = machine.cpu.de.uint16_value;
-    uint16_t result = 0;
-
-    switch (func) {
-    case P_TERMCPM:
-      machine.running = false;
-      break;
-    case C_RAWIO: {
-      uint8_t code = static_cast<uint8_t>(arg & 0xff);
-      switch (code) {
-      case 0xff: {
-        // CP/M 2.2/3: Non-blocking raw console read, no echo
-        if (!console_has_char()) {
-          result = 0; // No character available
-        } else {
-          char ch;
-          if (read(STDIN_FILENO, &ch, 1) == 1) {
-            if (ch == '\n') {
-              ch = '\r';
-            }
-            result = static_cast<uint8_t>(ch);
-          } else {
-            result = 0; // No character read
-          }
-        }
-        break;
-      }
-      case 0xfe:
-      case 0xfd:
-      case 0xfc:
-        // For now, treat unsupported variants as simple console output,
-        // per CP/M rule that unsupported codes output the character.
-        std::cout << static_cast<char>(code) << std::flush;
-        result = code;
-        break;
-      default:
-        // Values of E not supported output the character
-        std::cout << static_cast<char>(code) << std::flush;
-        result = code;
-        break;
-      }
-      break;
-    }
-    case C_READSTR: {
-      // CP/M 2.2/3 buffered console input:
-      // buffer[0] = max size, buffer[1] = current length, buffer[2..] = data
-      char buffer[256];
-      uint16_t index = 0;
-
-      // Simple line editor: echo, handle BS/DEL, stop on CR/LF
-      while (index < sizeof(buffer)) {
-        char ch;
-        if (read(STDIN_FILENO, &ch, 1) != 1) {
-          continue;
-        }
-        if (ch == '\r' || ch == '\n') {
-          break;
-        }
-        if (ch == '\b' || static_cast<unsigned char>(ch) == 0x7f) {
-          if (index > 0) {
-            index--;
-            std::cout << "\b \b" << std::flush;
-          }
-          continue;
-        }
-        buffer[index++] = ch;
-        std::cout << ch << std::flush;
-      }
-
-      uint8_t size = 0;
-
-      if (arg == 0) {
-        // Use DMA buffer; read size from DMA[0]
-        machine.memout(&size, machine.dma_address, 1);
-        if (size < 2) {
-          size = 2;
-        }
-        uint8_t len = std::min<uint8_t>(static_cast<uint8_t>(size - 2), index);
-        machine.memin(machine.dma_address + 1, &len, 1);
-        if (len > 0) {
-          machine.memin(machine.dma_address + 2, buffer, len);
-        }
-      } else {
-        // Use buffer at DE; read size from [DE]
-        machine.memout(&size, arg, 1);
-        if (size < 2) {
-          size = 2;
-        }
-        uint8_t len = std::min<uint8_t>(static_cast<uint8_t>(size - 2), index);
-        machine.memin(arg + 1, &len, 1);
-        if (len > 0) {
-          machine.memin(arg + 2, buffer, len);
-        }
-      }
-
-      result = 0; // Success
-      break;
-    }
-    case DRV_ALLRESET:
-      // Single-drive system: nothing to reset, report success
-      result = 0;
-      break;
-    case DRV_SET:
-      // Only drive A: (0) is valid; others return 0xFF in A
-      result = (arg == 0) ? 0x0000 : 0x00ff;
-      break;
-    case F_OPEN: {
-      FileControlBlock fcb;
-      machine.memout(&fcb, arg, sizeof(fcb));
-
-      std::string path = get_filename_from_fcb(fcb);
-      if (open_files.find(path) != open_files.end()) {
-        result = (FileAlreadyOpen << 8) | 0xff;
-        break;
-      }
-      if (path.find('?') != std::string::npos) {
-        // Wildcards not allowed for F_OPEN
-        result = (FilenameContainsWildcard << 8) | 0xff;
-        break;
-      }
-
-      std::fstream file;
-      file.open(path, std::ios::in | std::ios::out | std::ios::binary);
-      if (!file.is_open()) {
-        // File not found or other software-level error
-        result = (SoftwareError << 8) | 0xff;
-        break;
-      }
-
-      open_files[path] = std::move(file);
-      // For CP/M 2/3 compatibility, sequential position fields (EX,RC,CR)
-      // should be initialized to 0; assume caller did so.
-      result = 0; // Success (A=0)
-      break;
-    }
-    case F_CLOSE: {
-      FileControlBlock fcb;
-      machine.memout(&fcb, arg, sizeof(fcb));
-
-      std::string path = get_filename_from_fcb(fcb);
-      auto it = open_files.find(path);
-      if (it == open_files.end()) {
-        // File not open: treat as software-level error (A=0xFF, H=0)
-        result = 0x00ff;
-        break;
-      }
-
-      it->second.close();
-      open_files.erase(it);
-      result = 0; // Success
-      break;
-    }
-    case F_DELETE: {
-      FileControlBlock fcb;
-      machine.memout(&fcb, arg, sizeof(fcb));
-
-      std::string path = get_filename_from_fcb(fcb);
-
-      // NOTE: CP/M F_DELETE allows wildcards; this simple implementation
-      // treats the name literally and does not implement wildcard matching.
-      // Do NOT reject '?' here, to remain compatible with software that
-      // passes wildcards.
-
-      if (open_files.find(path) != open_files.end()) {
-        // CP/M would normally not allow deleting open files
-        result = (FileAlreadyOpen << 8) | 0xff;
-        break;
-      }
-
-      if (std::remove(path.c_str()) != 0) {
-        // File not found or other software-level error
-        result = (SoftwareError << 8) | 0xff;
-        break;
-      }
-
-      result = 0; // Success
-      break;
-    }
-    case F_READ: {
-      FileControlBlock fcb;
-      machine.memout(&fcb, arg, sizeof(fcb));
-
-      std::string path = get_filename_from_fcb(fcb);
-      auto it = open_files.find(path);
-      if (it == open_files.end()) {
-        result = 9; // Invalid FCB / file not open
-        break;
-      }
-
-      std::fstream &file = it->second;
-
-      char buffer[128];
-      file.read(buffer, sizeof(buffer));
-      std::streamsize got = file.gcount();
-
-      if (got <= 0) {
-        // End of file
-        result = 1; // EOF
-        break;
-      }
-
-      if (got < static_cast<std::streamsize>(sizeof(buffer))) {
-        std::memset(buffer + got, 0, sizeof(buffer) - static_cast<size_t>(got));
-      }
-
-      machine.memin(machine.dma_address, buffer, sizeof(buffer));
-
-      // For full CP/M compatibility, EX/RC/CR in the FCB should be updated
-      // to track sequential position; this implementation omits that logic.
-      result = 0; // Success
-      break;
-    }
-    case F_WRITE: {
-      FileControlBlock fcb;
-      machine.memout(&fcb, arg, sizeof(fcb));
-
-      std::string path = get_filename_from_fcb(fcb);
-      auto it = open_files.find(path);
-      if (it == open_files.end()) {
-        result = 9; // Invalid FCB / file not open
-        break;
-      }
-
-      std::fstream &file = it->second;
-
-      char buffer[128];
-      machine.memout(buffer, machine.dma_address, sizeof(buffer));
-      file.write(buffer, sizeof(buffer));
-
-      if (!file.good()) {
-        // Treat as software-level error (disk full etc.)
-        result = (SoftwareError << 8) | 0xff;
-        break;
-      }
-
-      // As with F_READ, EX/RC/CR in the FCB should track sequential position.
-      result = 0; // Success
-      break;
-    }
-    case F_MAKE: {
-      FileControlBlock fcb;
-      machine.memout(&fcb, arg, sizeof(fcb));
-
-      std::string path = get_filename_from_fcb(fcb);
-      if (open_files.find(path) != open_files.end()) {
-        result = (FileAlreadyExists << 8) | 0xff;
-        break;
-      }
-
-      if (path.find('?') != std::string::npos) {
-        // Wildcards not allowed for F_MAKE
-        result = (FilenameContainsWildcard << 8) | 0xff;
-        break;
-      }
-
-      // CP/M F_MAKE creates and opens the file for subsequent writes.
-      {
-        std::fstream file;
-        file.open(path, std::ios::out | std::ios::binary | std::ios::trunc);
-        if (!file.is_open()) {
-          result = (SoftwareError << 8) | 0xff;
-          break;
-        }
-        file.close();
-      }
-
-      std::fstream rwfile;
-      rwfile.open(path, std::ios::in | std::ios::out | std::ios::binary);
-      if (!rwfile.is_open()) {
-        // Creation succeeded but reopen for R/W failed: treat as software error
-        result = (SoftwareError << 8) | 0xff;
-        break;
-      }
-
-      open_files[path] = std::move(rwfile);
-      // On a real CP/M system, FCB allocation info would be initialized here.
-      // The file is now open at record 0 for sequential F_WRITE calls.
-      result = 0; // Success
-      break;
-    }
-    case DRV_GET:
-      // Always drive A: (0)
-      result = 0;
-      break;
-    case F_READRAND: {
-      FileControlBlock fcb;
-      machine.memout(&fcb, arg, sizeof(fcb));
-
-      std::string path = get_filename_from_fcb(fcb);
-      auto it = open_files.find(path);
-      if (it == open_files.end()) {
-        result = 9; // Invalid FCB / file not open
-        break;
-      }
-
-      std::fstream &file = it->second;
-
-      uint32_t recnum = 0;
-      recnum |= static_cast<uint32_t>(fcb.r[0]);
-      recnum |= static_cast<uint32_t>(fcb.r[1]) << 8;
-      recnum |= static_cast<uint32_t>(fcb.r[2]) << 16;
-
-      std::streamoff offset = static_cast<std::streamoff>(recnum) * 128;
-      file.clear();
-      file.seekg(offset, std::ios::beg);
-      if (!file.good()) {
-        // Record out of range
-        result = 6;
-        break;
-      }
-
-      char buffer[128];
-      file.read(buffer, sizeof(buffer));
-      std::streamsize got = file.gcount();
-
-      if (got <= 0) {
-        // Reading unwritten data / beyond EOF
-        result = 1;
-        break;
-      }
-      if (got < static_cast<std::streamsize>(sizeof(buffer))) {
-        std::memset(buffer + got, 0, sizeof(buffer) - static_cast<size_t>(got));
-      }
-
-      machine.memin(machine.dma_address, buffer, sizeof(buffer));
-
-      // Real BDOS would also update EX/RC/CR to match this random position.
-      result = 0; // Success
-      break;
-    }
-    default:
-      std::cout << std::format(
-                       "Fatal: unknown BDOS system call {} with argument {}",
-                       func, arg)
-                << std::endl;
-      machine.running = false;
-      break;
-    }
+    uint16_t result = machine.bdos.call(func, arg);
 
     // CP/M 2+/3 style return:
     // A = low byte; HL = full 16-bit result; H may carry CP/M 3 error code.
@@ -394,19 +58,102 @@ static zuint8 fetch_opcode(void *context, zuint16 address) {
     machine.cpu.hl.uint16_value = result;
     return 0xC9; // RET
   }
-  return machine.memory[address];
+
+  uint8_t opcode = machine.memory[address];
+  if (opcode == TRAP_OPCODE) [[unlikely]] {
+    auto it = machine.traps.find(address);
+    if (it != machine.traps.end()) {
+      return it->second.handler(machine, address);
+    }
+  }
+  if (machine.delay_loops == DelayLoopMode::FastForward &&
+      may_start_delay_loop(opcode)) {
+    fast_forward_delay_loop(machine, address);
+  }
+  return opcode;
 }
 
-Machine::Machine() {
+static void reset_cpu(Machine &machine) {
+  Z80 &cpu = machine.cpu;
   memset(&cpu, 0, sizeof(cpu));
-  cpu.context = this;
+  cpu.context = &machine;
   cpu.pc.uint16_value = 0x0100;
-  cpu.sp.uint16_value = 0;
+  // The stack starts below the BDOS with 0000h on top, so a program can
+  // return to CP/M with RET
+  cpu.sp.uint16_value = BDOS_BASE - 2;
 
   cpu.fetch_opcode = fetch_opcode;
-  cpu.fetch = read_memory;
-  cpu.read = read_memory;
-  cpu.write = write_memory;
+  install_read(machine);
+  cpu.write = machine.write_protected.any() ? write_memory_checked
+                                            : write_memory;
+}
+
+Machine::Machine() { reset_cpu(*this); }
+
+void Machine::warm_boot() {
+  // A warm boot returns to the CCP: files left open by the previous program
+  // are dropped and the CPU starts over at the TPA. The TPA contents are left
+  // alone; the next program is loaded on top of them.
+  reset_cpu(*this);
+  init_cpm_zero_page();
+  bdos.reset();
+  running = true;
+}
+
+bool Machine::load_program(const std::filesystem::path &path) {
+  std::ifstream program_file(path, std::ios::binary);
+  if (!program_file) {
+    return false;
+  }
+
+  // Routines found in the previous program no longer apply
+  accel.clear();
+
+  // The TPA runs up to the BDOS
+  program_file.read(reinterpret_cast<char *>(&memory[0x0100]),
+                    BDOS_BASE - 0x0100);
+  if (program_file.gcount() == BDOS_BASE - 0x0100 &&
+      program_file.peek() != EOF) {
+    return false;
+  }
+
+  // Traps (e.g. debugger breakpoints) stay armed over the new program. Only
+  // the bytes it was loaded over have changed under them.
+  uint32_t end = 0x0100 + static_cast<uint32_t>(program_file.gcount());
+  for (auto &[address, trap] : traps) {
+    if (address >= 0x0100 && address < end) {
+      trap.original = memory[address];
+    }
+    memory[address] = TRAP_OPCODE;
+  }
+  accel.scan(0x0100, static_cast<uint16_t>(end));
+  return !program_file.bad();
+}
+
+void Machine::set_command_tail(std::string_view tail) {
+  // 0080: Command tail length, 0081–00FF: tail text, NUL terminated
+  uint8_t length = static_cast<uint8_t>(std::min<size_t>(tail.size(), 0x7e));
+  memory[0x0080] = length;
+  std::memcpy(&memory[0x0081], tail.data(), length);
+  memory[0x0081 + length] = 0x00;
+}
+
+void Machine::run() {
+  if (debugger) [[unlikely]] {
+    debugger->program_started();
+  }
+  while (running) {
+    cycles += z80_execute(&cpu, governor.slice());
+    if (debugger) [[unlikely]] {
+      debugger->slice_finished();
+    }
+    governor.pace(cycles);
+  }
+}
+
+void Machine::stop() {
+  running = false;
+  z80_break(&cpu);
 }
 
 void Machine::init_cpm_zero_page() {
@@ -427,10 +174,11 @@ void Machine::init_cpm_zero_page() {
   memory[0x0004] = 0x00;
 
   // 0005–0007: BDOS entry. Real CP/M uses "JMP BDOS". We trap on PC==5
-  // in fetch_opcode, so the contents are irrelevant, but we keep it sane:
-  memory[0x0005] = 0xC3; // JMP 0005h (self‑jump; never actually executed)
-  memory[0x0006] = 0x05;
-  memory[0x0007] = 0x00;
+  // in fetch_opcode, so the jump never runs, but programs read 0006h to find
+  // the top of the TPA, so it points at the BDOS area.
+  memory[0x0005] = 0xC3; // JMP BDOS_BASE
+  memory[0x0006] = static_cast<uint8_t>(BDOS_BASE);
+  memory[0x0007] = static_cast<uint8_t>(BDOS_BASE >> 8);
 
   // 0008–003F: 8080 restart/interrupt vectors and reserved – left as 0
 
@@ -462,19 +210,98 @@ void Machine::init_cpm_zero_page() {
   memory[0x0080] = 0x00;
 
   // 0081–00FF: Command tail – left as 0
+}
 
-  // Default BDOS DMA address: standard CP/M is 0080h
-  dma_address = 0x0080;
+bool Machine::set_trap(uint16_t address, TrapHandler handler) {
+  auto [it, inserted] = traps.try_emplace(address);
+  if (!inserted) {
+    return false;
+  }
+  it->second.original = memory[address];
+  it->second.handler = std::move(handler);
+  memory[address] = TRAP_OPCODE;
+  install_read(*this);
+  return true;
+}
+
+void Machine::clear_trap(uint16_t address) {
+  auto it = traps.find(address);
+  if (it == traps.end()) {
+    return;
+  }
+  // The program may have overwritten the trap since it was set
+  if (memory[address] == TRAP_OPCODE) {
+    memory[address] = it->second.original;
+  }
+  traps.erase(it);
+  install_read(*this);
+}
+
+uint8_t Machine::peek(uint16_t address) const {
+  if (memory[address] == TRAP_OPCODE) {
+    auto it = traps.find(address);
+    if (it != traps.end()) {
+      return it->second.original;
+    }
+  }
+  return memory[address];
+}
+
+void Machine::poke(uint16_t address, uint8_t value) {
+  auto it = traps.find(address);
+  if (it != traps.end() && memory[address] == TRAP_OPCODE) {
+    it->second.original = value;
+  } else {
+    memory[address] = value;
+  }
+}
+
+void Machine::set_write_protect(const void *owner, std::bitset<256> pages,
+                                WriteHandler handler) {
+  std::erase_if(write_watches,
+                [&](const WriteWatch &watch) { return watch.owner == owner; });
+  if (pages.any()) {
+    write_watches.push_back({owner, pages, std::move(handler)});
+  }
+  write_protected.reset();
+  for (const WriteWatch &watch : write_watches) {
+    write_protected |= watch.pages;
+  }
+  cpu.write = write_protected.any() ? write_memory_checked : write_memory;
+}
+
+void Machine::protected_write(uint16_t address) {
+  for (const WriteWatch &watch : write_watches) {
+    if (watch.pages[address >> 8]) {
+      watch.handler(*this, address);
+    }
+  }
 }
 
 void Machine::memin(uint16_t dest, void *src, uint16_t count) {
   for (uint16_t i = 0; i < count; i++) {
-    memory[dest + i] = ((uint8_t *)src)[i];
+    memory[static_cast<uint16_t>(dest + i)] = ((uint8_t *)src)[i];
+  }
+  if (write_protected.none()) {
+    return;
+  }
+  // BDOS writes (F_READ into the DMA buffer, say) count as the program's
+  for (uint16_t i = 0; i < count; i++) {
+    uint16_t address = static_cast<uint16_t>(dest + i);
+    if (write_protected[address >> 8]) {
+      protected_write(address);
+    }
   }
 }
 
 void Machine::memout(void *dest, uint16_t src, uint16_t count) {
+  if (traps.empty()) {
+    for (uint16_t i = 0; i < count; i++) {
+      ((uint8_t *)dest)[i] = memory[static_cast<uint16_t>(src + i)];
+    }
+    return;
+  }
   for (uint16_t i = 0; i < count; i++) {
-    ((uint8_t *)dest)[i] = memory[src + i];
+    ((uint8_t *)dest)[i] = peek(static_cast<uint16_t>(src + i));
   }
 }
@@ -2,24 +2,123 @@
 #include <Z/types/integral.h>
 #include <Z80.h>
 #include <bdos.hpp>
-#include <filesystem>
-#include <fstream>
+#include <ccp.hpp>
+#include <charconv>
+#include <file_cache.hpp>
+#include <gdb_stub.hpp>
 #include <iostream>
 #include <optional>
+#include <scheduler.hpp>
+#include <string>
+#include <string_view>
 #include <termios.h>
 #include <unistd.h>
+#include <vector>
 
 struct Args {
-  std::filesystem::path program;
+  // Command line for the CCP; empty for an interactive prompt
+  std::string command;
+  DelayLoopMode delay_loops = DelayLoopMode::FastForward;
+  // Emulated clock in Hz, 0 for unthrottled
+  uint64_t clock_hz = 0;
+  bool stats = false;
+  TerminalType terminal = TerminalType::Ansi;
+  // Where to listen for gdb, if debugging
+  std::string gdb;
+  BdosProfile bdos = BdosProfile::Cpm22;
+  AccelMode accel = AccelMode::Native;
+  // Further commands to run as concurrent MP/M processes
+  std::vector<std::string> processes;
 };
 
+static void print_usage(const char *argv0) {
+  std::cerr << "Usage: " << argv0 << " [options] [<program_path> [args...]]\n"
+            << "       " << argv0 << " [options] <file.sub> [args...]\n"
+            << "  Commands may be chained with '!'. Without a program, an\n"
+            << "  interactive A> prompt is started.\n"
+            << "Options:\n"
+            << "  --delay-loops=fast|exact  Fast-forward calibrated delay "
+               "loops (default: fast)\n"
+            << "  --clock=<MHz>             Pace emulation to the given clock "
+               "speed, e.g. --clock=4\n"
+            << "  --stats                   Print timing and host CPU usage on "
+               "exit\n"
+            << "  --terminal=ansi|adm3a|vt52\n"
+            << "                            Terminal the program expects; "
+               "output is translated to ANSI (default: ansi)\n"
+            << "  --bdos=cpm22|cpm3|mpm     BDOS to emulate (default: cpm22)\n"
+            << "  --accel=on|off|verify     Run known runtime routines natively "
+               "(default: on)\n"
+            << "  --process=<command>       Run the command as another MP/M "
+               "process alongside the\n"
+            << "                            main one (implies --bdos=mpm; "
+               "may be repeated)\n"
+            << "  --gdb=[localhost:]<port>|<socket_path>\n"
+            << "                            Wait for a gdb remote connection "
+               "before running"
+            << std::endl;
+}
+
 std::optional<Args> parse_args(int argc, char *argv[]) {
-  if (argc < 2) {
-    std::cerr << "Usage: " << argv[0] << " <program_path> [...]" << std::endl;
-    return std::nullopt;
-  }
   Args args;
-  args.program = std::filesystem::path(argv[1]);
+  int i = 1;
+  for (; i < argc; i++) {
+    std::string_view arg = argv[i];
+    if (!arg.starts_with("--")) {
+      break;
+    }
+    if (arg == "--delay-loops=fast") {
+      args.delay_loops = DelayLoopMode::FastForward;
+    } else if (arg == "--delay-loops=exact") {
+      args.delay_loops = DelayLoopMode::Faithful;
+    } else if (arg.starts_with("--clock=")) {
+      std::string_view value = arg.substr(8);
+      double mhz = 0;
+      auto [end, ec] =
+          std::from_chars(value.data(), value.data() + value.size(), mhz);
+      if (ec != std::errc() || end != value.data() + value.size() ||
+          mhz <= 0) {
+        std::cerr << "Error: Invalid clock speed: " << value << std::endl;
+        return std::nullopt;
+      }
+      args.clock_hz = static_cast<uint64_t>(mhz * 1e6);
+    } else if (arg == "--stats") {
+      args.stats = true;
+    } else if (arg == "--terminal=ansi") {
+      args.terminal = TerminalType::Ansi;
+    } else if (arg == "--terminal=adm3a") {
+      args.terminal = TerminalType::Adm3a;
+    } else if (arg == "--terminal=vt52") {
+      args.terminal = TerminalType::Vt52;
+    } else if (arg == "--bdos=cpm22") {
+      args.bdos = BdosProfile::Cpm22;
+    } else if (arg == "--bdos=cpm3") {
+      args.bdos = BdosProfile::Cpm3;
+    } else if (arg == "--bdos=mpm") {
+      args.bdos = BdosProfile::Mpm;
+    } else if (arg == "--accel=on") {
+      args.accel = AccelMode::Native;
+    } else if (arg == "--accel=off") {
+      args.accel = AccelMode::Off;
+    } else if (arg == "--accel=verify") {
+      args.accel = AccelMode::Verify;
+    } else if (arg.starts_with("--process=")) {
+      args.processes.emplace_back(arg.substr(10));
+      args.bdos = BdosProfile::Mpm;
+    } else if (arg.starts_with("--gdb=")) {
+      args.gdb = arg.substr(6);
+    } else {
+      std::cerr << "Error: Unknown option: " << arg << std::endl;
+      print_usage(argv[0]);
+      return std::nullopt;
+    }
+  }
+  for (; i < argc; i++) {
+    if (!args.command.empty()) {
+      args.command += ' ';
+    }
+    args.command += argv[i];
+  }
   return args;
 }
 
@@ -29,19 +128,28 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
-  std::ifstream program_file(args->program, std::ios::binary);
-  if (!program_file) {
-    std::cerr << "Error: Could not open program file: " << args->program
-              << std::endl;
-    return 1;
-  }
+  // Session options, applied to every machine
+  auto configure = [&](Machine &machine) {
+    machine.delay_loops = args->delay_loops;
+    machine.governor = ClockGovernor(args->clock_hz);
+    machine.terminal = Terminal(args->terminal);
+    machine.bdos.set_profile(args->bdos);
+    machine.accel.set_mode(args->accel);
+  };
 
   Machine machine;
-  machine.init_cpm_zero_page();
+  configure(machine);
+  Ccp ccp(machine);
+  SessionStats stats;
+  Scheduler scheduler(args->clock_hz);
 
-  for (unsigned addr = 0x0100; addr < sizeof(machine.memory) && !program_file.eof();
-       addr++) {
-    machine.memory[addr] = program_file.get();
+  if (!args->processes.empty() && !args->gdb.empty()) {
+    std::cerr << "Error: --gdb cannot be used with --process" << std::endl;
+    return 1;
+  }
+  GdbStub debugger(machine);
+  if (!args->gdb.empty() && !debugger.listen(args->gdb)) {
+    return 1;
   }
 
   // We need to disable canonical mode and echoing for proper console I/O
@@ -51,11 +159,37 @@ int main(int argc, char *argv[]) {
   newt.c_lflag &= ~(ICANON | ECHO);
   tcsetattr(STDIN_FILENO, TCSANOW, &newt);
 
-  while (machine.running) {
-    z80_execute(&machine.cpu, 1);
+  bool ok = true;
+  uint64_t cycles = 0;
+  if (!args->processes.empty()) {
+    // MP/M: every command is a process, scheduled together
+    if (!args->command.empty()) {
+      args->processes.push_back(args->command);
+    }
+    for (const std::string &command : args->processes) {
+      ok = scheduler.spawn(command, configure) && ok;
+    }
+    ok = scheduler.run() && ok;
+    cycles = scheduler.cycles();
+  } else if (args->command.empty()) {
+    ccp.interactive();
+    cycles = machine.cycles;
+  } else {
+    ok = ccp.execute(args->command);
+    cycles = machine.cycles;
   }
 
   tcsetattr(STDIN_FILENO, TCSANOW, &old);
 
-  return 0;
+  if (args->stats) {
+    stats.report(std::cerr, cycles, args->clock_hz);
+    FileCache::instance().report(std::cerr);
+    if (!args->processes.empty()) {
+      scheduler.report(std::cerr);
+    } else {
+      machine.accel.report(std::cerr);
+    }
+  }
+
+  return ok ? 0 : 1;
 }
@@ -0,0 +1,593 @@
+#include <Z80.h>
+#include <algorithm>
+#include <cctype>
+#include <ccp.hpp>
+#include <console.hpp>
+#include <format>
+#include <iostream>
+#include <machine.hpp>
+#include <optional>
+#include <scheduler.hpp>
+#include <sys/select.h>
+#include <unistd.h>
+
+// T-states per tick when the clock is not throttled: a 4 MHz Z80
+static constexpr uint64_t DEFAULT_QUANTUM = 4'000'000 / MPM_TICKS_PER_SECOND;
+
+// Queue control block (Q_MAKE, Q_DELETE): link, name, message length,
+// number of messages
+static constexpr uint16_t QCB_NAME = 2;
+static constexpr uint16_t QCB_MSGLEN = 10;
+static constexpr uint16_t QCB_NMBMSGS = 12;
+// User queue control block: queue (filled in by Q_OPEN), message address,
+// name
+static constexpr uint16_t UQCB_POINTER = 0;
+static constexpr uint16_t UQCB_MSGADR = 2;
+static constexpr uint16_t UQCB_NAME = 4;
+// Process descriptor fields kept up to date in each bank
+static constexpr uint16_t PD_PRIORITY = 3;
+static constexpr uint16_t PD_NAME = 6;
+
+using std::chrono::steady_clock;
+
+namespace {
+
+uint16_t word(const Machine &machine, uint16_t address) {
+  return static_cast<uint16_t>(machine.memory[address] |
+                               machine.memory[uint16_t(address + 1)] << 8);
+}
+
+void set_word(Machine &machine, uint16_t address, uint16_t value) {
+  machine.memory[address] = static_cast<uint8_t>(value);
+  machine.memory[uint16_t(address + 1)] = static_cast<uint8_t>(value >> 8);
+}
+
+// An 8-character MP/M name (process or queue), attribute bits stripped
+std::string read_name(const Machine &machine, uint16_t address) {
+  std::string name(8, ' ');
+  for (uint16_t i = 0; i < 8; i++) {
+    name[i] = static_cast<char>(machine.memory[uint16_t(address + i)] & 0x7f);
+  }
+  return name;
+}
+
+// Process name for a command line: the program name, upper case and padded
+std::string process_name(std::string_view command) {
+  command.remove_prefix(std::min(command.find_first_not_of(" \t"),
+                                 command.size()));
+  std::string_view word = command.substr(0, command.find_first_of(" \t"));
+  size_t slash = word.find_last_of('/');
+  if (slash != std::string_view::npos) {
+    word.remove_prefix(slash + 1);
+  }
+  word = word.substr(0, word.find('.'));
+
+  std::string name(8, ' ');
+  for (size_t i = 0; i < word.size() && i < name.size(); i++) {
+    name[i] = static_cast<char>(std::toupper(static_cast<unsigned char>(word[i])));
+  }
+  return name;
+}
+
+void update_descriptor(Process &process) {
+  Machine &machine = *process.machine;
+  std::copy(process.name.begin(), process.name.end(),
+            &machine.memory[BDOS_PD + PD_NAME]);
+  machine.memory[BDOS_PD + PD_PRIORITY] = process.priority;
+}
+
+// -- Console --------------------------------------------------------------------
+
+// C_READ / C_READSTR: input goes to the process with the console attached,
+// attaching it if it is free. C_READSTR reads the whole line once the first
+// key is in, so other processes pause while a line is typed.
+template <uint8_t F> uint16_t console_input(Bdos &bdos, uint16_t arg) {
+  Scheduler &scheduler = *bdos.scheduler;
+  if (!scheduler.attach_console(scheduler.current())) {
+    return scheduler.wait(bdos, ProcessState::WaitConsole);
+  }
+  if (!console_has_char()) {
+    return scheduler.wait(bdos, ProcessState::WaitInput);
+  }
+  return scheduler.base_functions[F](bdos, arg);
+}
+
+// C_WRITE / C_WRITESTR: output also needs the console, so one process's
+// escape sequences are never interleaved with another's. As in MP/M II, the
+// console stays attached until the process detaches it or terminates.
+template <uint8_t F> uint16_t console_output(Bdos &bdos, uint16_t arg) {
+  Scheduler &scheduler = *bdos.scheduler;
+  if (!scheduler.attach_console(scheduler.current())) {
+    return scheduler.wait(bdos, ProcessState::WaitConsole);
+  }
+  return scheduler.base_functions[F](bdos, arg);
+}
+
+uint16_t console_status(Bdos &bdos, uint16_t arg) {
+  Scheduler &scheduler = *bdos.scheduler;
+  if (scheduler.console_owned_by_other(scheduler.current())) {
+    return 0x00; // Typing is for someone else
+  }
+  return scheduler.base_functions[C_STAT](bdos, arg);
+}
+
+uint16_t console_rawio(Bdos &bdos, uint16_t arg) {
+  Scheduler &scheduler = *bdos.scheduler;
+  if ((arg & 0xff) == 0xff) {
+    if (scheduler.console_owned_by_other(scheduler.current())) {
+      return 0x00; // No character available
+    }
+    return scheduler.base_functions[C_RAWIO](bdos, arg);
+  }
+  return console_output<C_RAWIO>(bdos, arg);
+}
+
+uint16_t c_attach(Bdos &bdos, uint16_t) {
+  Scheduler &scheduler = *bdos.scheduler;
+  if (!scheduler.attach_console(scheduler.current())) {
+    return scheduler.wait(bdos, ProcessState::WaitConsole);
+  }
+  return 0;
+}
+
+uint16_t c_cattach(Bdos &bdos, uint16_t) {
+  Scheduler &scheduler = *bdos.scheduler;
+  return scheduler.attach_console(scheduler.current()) ? 0x0000 : 0x00ff;
+}
+
+uint16_t c_detach(Bdos &bdos, uint16_t) {
+  Scheduler &scheduler = *bdos.scheduler;
+  scheduler.detach_console(scheduler.current());
+  return 0;
+}
+
+uint16_t c_assign(Bdos &bdos, uint16_t arg) {
+  // Console assign block: console, process descriptor, match flag, name
+  Scheduler &scheduler = *bdos.scheduler;
+  Process &process = scheduler.current();
+  Process *target =
+      scheduler.find_process(read_name(bdos.machine, uint16_t(arg + 4)));
+  if (!target || bdos.machine.memory[arg] != 0 ||
+      scheduler.console_owned_by_other(process)) {
+    return 0x00ff;
+  }
+  scheduler.detach_console(process);
+  scheduler.attach_console(*target);
+  return 0;
+}
+
+// -- Processes --------------------------------------------------------------------
+
+uint16_t p_delay(Bdos &bdos, uint16_t arg) {
+  return bdos.scheduler->delay(bdos, arg);
+}
+
+uint16_t p_dispatch(Bdos &bdos, uint16_t) {
+  bdos.scheduler->yield();
+  return 0;
+}
+
+uint16_t p_priority(Bdos &bdos, uint16_t arg) {
+  Scheduler &scheduler = *bdos.scheduler;
+  Process &process = scheduler.current();
+  process.priority = static_cast<uint8_t>(arg);
+  update_descriptor(process);
+  // A lower priority may mean another process should run now
+  scheduler.yield();
+  return 0;
+}
+
+uint16_t p_abort(Bdos &bdos, uint16_t arg) {
+  // Abort parameter block: process descriptor, termination code, memory
+  // segment, name
+  Scheduler &scheduler = *bdos.scheduler;
+  Process *target =
+      scheduler.find_process(read_name(bdos.machine, uint16_t(arg + 4)));
+  if (!target) {
+    return 0x00ff;
+  }
+  scheduler.terminate(*target);
+  return 0;
+}
+
+// -- Flags ------------------------------------------------------------------------
+
+uint16_t dev_waitflag(Bdos &bdos, uint16_t arg) {
+  Scheduler &scheduler = *bdos.scheduler;
+  uint8_t flag = static_cast<uint8_t>(arg);
+  if (flag >= scheduler.flags.size()) {
+    return 0x00ff;
+  }
+  if (!scheduler.flags[flag]) {
+    return scheduler.wait(bdos, ProcessState::WaitFlag);
+  }
+  scheduler.flags.reset(flag);
+  return 0;
+}
+
+uint16_t dev_setflag(Bdos &bdos, uint16_t arg) {
+  Scheduler &scheduler = *bdos.scheduler;
+  uint8_t flag = static_cast<uint8_t>(arg);
+  if (flag >= scheduler.flags.size() || scheduler.flags[flag]) {
+    // Invalid flag, or set twice without a wait in between
+    return 0x00ff;
+  }
+  scheduler.flags.set(flag);
+  scheduler.wake(ProcessState::WaitFlag);
+  return 0;
+}
+
+// -- Queues -----------------------------------------------------------------------
+
+MessageQueue *find_queue(Scheduler &scheduler, const std::string &name,
+                         uint16_t *id = nullptr) {
+  for (auto &[queue_id, queue] : scheduler.queues) {
+    if (queue.name == name) {
+      if (id) {
+        *id = queue_id;
+      }
+      return &queue;
+    }
+  }
+  return nullptr;
+}
+
+// The queue a UQCB was opened on
+MessageQueue *opened_queue(Bdos &bdos, uint16_t uqcb) {
+  auto &queues = bdos.scheduler->queues;
+  auto it = queues.find(word(bdos.machine, uint16_t(uqcb + UQCB_POINTER)));
+  return it == queues.end() ? nullptr : &it->second;
+}
+
+uint16_t q_make(Bdos &bdos, uint16_t arg) {
+  Scheduler &scheduler = *bdos.scheduler;
+  Machine &machine = bdos.machine;
+  std::string name = read_name(machine, uint16_t(arg + QCB_NAME));
+  if (find_queue(scheduler, name)) {
+    return 0x00ff;
+  }
+
+  MessageQueue queue{name, word(machine, uint16_t(arg + QCB_MSGLEN)),
+                     word(machine, uint16_t(arg + QCB_NMBMSGS)),
+                     {}};
+  // A mutual exclusion queue starts out holding its one (empty) message
+  if (name.starts_with("MX") && queue.message_length == 0) {
+    queue.messages.emplace_back();
+  }
+  scheduler.queues[scheduler.next_queue_id++] = std::move(queue);
+  return 0;
+}
+
+uint16_t q_open(Bdos &bdos, uint16_t arg) {
+  uint16_t id;
+  if (!find_queue(*bdos.scheduler,
+                  read_name(bdos.machine, uint16_t(arg + UQCB_NAME)), &id)) {
+    return 0x00ff;
+  }
+  // Banks cannot see each other's QCBs, so the UQCB holds a queue number
+  set_word(bdos.machine, uint16_t(arg + UQCB_POINTER), id);
+  return 0;
+}
+
+uint16_t q_delete(Bdos &bdos, uint16_t arg) {
+  Scheduler &scheduler = *bdos.scheduler;
+  uint16_t id;
+  if (!find_queue(scheduler, read_name(bdos.machine, uint16_t(arg + QCB_NAME)),
+                  &id)) {
+    return 0x00ff;
+  }
+  scheduler.queues.erase(id);
+  // Anyone waiting on it gets an error when they retry
+  scheduler.wake(ProcessState::WaitQueue);
+  return 0;
+}
+
+template <bool Conditional> uint16_t q_read(Bdos &bdos, uint16_t arg) {
+  Scheduler &scheduler = *bdos.scheduler;
+  MessageQueue *queue = opened_queue(bdos, arg);
+  if (!queue) {
+    return 0x00ff;
+  }
+  if (queue->messages.empty()) {
+    return Conditional ? 0x00ff
+                       : scheduler.wait(bdos, ProcessState::WaitQueue);
+  }
+
+  std::vector<uint8_t> message = std::move(queue->messages.front());
+  queue->messages.pop_front();
+  if (!message.empty()) {
+    bdos.machine.memin(word(bdos.machine, uint16_t(arg + UQCB_MSGADR)),
+                       message.data(), static_cast<uint16_t>(message.size()));
+  }
+  // Writers may be waiting for room
+  scheduler.wake(ProcessState::WaitQueue);
+  return 0;
+}
+
+template <bool Conditional> uint16_t q_write(Bdos &bdos, uint16_t arg) {
+  Scheduler &scheduler = *bdos.scheduler;
+  MessageQueue *queue = opened_queue(bdos, arg);
+  if (!queue) {
+    return 0x00ff;
+  }
+  if (queue->messages.size() >= std::max<uint16_t>(queue->capacity, 1)) {
+    return Conditional ? 0x00ff
+                       : scheduler.wait(bdos, ProcessState::WaitQueue);
+  }
+
+  std::vector<uint8_t> message(queue->message_length);
+  if (!message.empty()) {
+    bdos.machine.memout(message.data(),
+                        word(bdos.machine, uint16_t(arg + UQCB_MSGADR)),
+                        static_cast<uint16_t>(message.size()));
+  }
+  queue->messages.push_back(std::move(message));
+  // Readers may be waiting for a message
+  scheduler.wake(ProcessState::WaitQueue);
+  return 0;
+}
+
+// Replace the MP/M profile's single-process stand-ins
+void install(Bdos &bdos) {
+  bdos.set_function(C_READ, &console_input<C_READ>);
+  bdos.set_function(C_READSTR, &console_input<C_READSTR>);
+  bdos.set_function(C_STAT, &console_status);
+  bdos.set_function(C_RAWIO, &console_rawio);
+  bdos.set_function(C_WRITE, &console_output<C_WRITE>);
+  bdos.set_function(C_WRITESTR, &console_output<C_WRITESTR>);
+  bdos.set_function(DEV_WAITFLAG, &dev_waitflag);
+  bdos.set_function(DEV_SETFLAG, &dev_setflag);
+  bdos.set_function(Q_MAKE, &q_make);
+  bdos.set_function(Q_OPEN, &q_open);
+  bdos.set_function(Q_DELETE, &q_delete);
+  bdos.set_function(Q_READ, &q_read<false>);
+  bdos.set_function(Q_CREAD, &q_read<true>);
+  bdos.set_function(Q_WRITE, &q_write<false>);
+  bdos.set_function(Q_CWRITE, &q_write<true>);
+  bdos.set_function(P_DELAY, &p_delay);
+  bdos.set_function(P_DISPATCH, &p_dispatch);
+  bdos.set_function(P_PRIORITY, &p_priority);
+  bdos.set_function(C_ATTACH, &c_attach);
+  bdos.set_function(C_DETACH, &c_detach);
+  bdos.set_function(C_CATTACH, &c_cattach);
+  bdos.set_function(C_ASSIGN, &c_assign);
+  bdos.set_function(P_ABORT, &p_abort);
+}
+
+} // namespace
+
+Scheduler::Scheduler(uint64_t clock_hz)
+    : governor(clock_hz),
+      quantum(clock_hz ? clock_hz / MPM_TICKS_PER_SECOND : DEFAULT_QUANTUM) {}
+
+Scheduler::~Scheduler() = default;
+
+bool Scheduler::spawn(std::string_view command,
+                      const std::function<void(Machine &)> &configure) {
+  auto process = std::make_unique<Process>();
+  process->machine = std::make_unique<Machine>();
+  Machine &machine = *process->machine;
+  configure(machine);
+  machine.bdos.set_profile(BdosProfile::Mpm);
+  machine.bdos.scheduler = this;
+  for (unsigned func = 0; func < base_functions.size(); func++) {
+    base_functions[func] = machine.bdos.get_function(func);
+  }
+  install(machine.bdos);
+
+  process->ccp = std::make_unique<Ccp>(machine);
+  bool ok;
+  if (!process->ccp->prepare(command, ok)) {
+    // Not found, or a built-in command that has already run
+    return ok;
+  }
+  process->name = process_name(command);
+  update_descriptor(*process);
+  processes.push_back(std::move(process));
+  return true;
+}
+
+uint16_t Scheduler::wait(Bdos &bdos, ProcessState state) {
+  running->state = state;
+  // The RET ending this call returns to 0005h instead of the caller, so the
+  // call is made again when the process runs next
+  Z80 &cpu = bdos.machine.cpu;
+  uint16_t sp = static_cast<uint16_t>(cpu.sp.uint16_value - 2);
+  cpu.sp.uint16_value = sp;
+  set_word(bdos.machine, sp, 0x0005);
+  z80_break(&cpu);
+  return 0;
+}
+
+uint16_t Scheduler::delay(Bdos &bdos, uint16_t ticks) {
+  running->state = ProcessState::Delayed;
+  running->wake_time =
+      steady_clock::now() + std::chrono::microseconds(
+                                int64_t(ticks) * 1'000'000 / MPM_TICKS_PER_SECOND);
+  z80_break(&bdos.machine.cpu);
+  return 0;
+}
+
+void Scheduler::yield() {
+  if (running) {
+    z80_break(&running->machine->cpu);
+  }
+}
+
+void Scheduler::wake(ProcessState state) {
+  bool woken = false;
+  for (auto &process : processes) {
+    if (process->state == state) {
+      process->state = ProcessState::Ready;
+      woken = true;
+    }
+  }
+  if (woken) {
+    // Let the dispatcher choose again, in case one of them comes first
+    yield();
+  }
+}
+
+Process *Scheduler::find_process(std::string_view name) {
+  for (auto &process : processes) {
+    if (process->state != ProcessState::Done && process->name == name) {
+      return process.get();
+    }
+  }
+  return nullptr;
+}
+
+void Scheduler::terminate(Process &process) {
+  // Picked up by the dispatcher, which also handles processes that exit
+  process.machine->stop();
+}
+
+bool Scheduler::attach_console(Process &process) {
+  if (console_owned_by_other(process)) {
+    return false;
+  }
+  console_owner = &process;
+  return true;
+}
+
+void Scheduler::detach_console(Process &process) {
+  if (console_owner == &process) {
+    console_owner = nullptr;
+    wake(ProcessState::WaitConsole);
+  }
+}
+
+void Scheduler::report(std::ostream &out) const {
+  for (const auto &process : processes) {
+    const Accelerator &accel = process->machine->accel;
+    if (accel.empty()) {
+      continue;
+    }
+    std::string_view name = process->name;
+    out << std::format("Process {}:\n",
+                       name.substr(0, name.find_last_not_of(' ') + 1));
+    accel.report(out);
+  }
+  out.flush();
+}
+
+void Scheduler::finished(Process &process) {
+  // P_CHAIN / P_CLI: the process carries on with another program
+  Bdos &bdos = process.machine->bdos;
+  std::string chained = std::move(bdos.chain_command);
+  bdos.chain_command.clear();
+  bool ok;
+  if (!chained.empty() && process.ccp->prepare(chained, ok)) {
+    process.name = process_name(chained);
+    process.state = ProcessState::Ready;
+    update_descriptor(process);
+    return;
+  }
+
+  process.state = ProcessState::Done;
+  detach_console(process);
+}
+
+Process *Scheduler::pick() {
+  auto now = steady_clock::now();
+  std::optional<bool> input;
+  unsigned best = 256;
+  for (auto &process : processes) {
+    if (process->state != ProcessState::Done && !process->machine->running) {
+      finished(*process);
+    }
+    switch (process->state) {
+    case ProcessState::Delayed:
+      if (now >= process->wake_time) {
+        process->state = ProcessState::Ready;
+      }
+      break;
+    case ProcessState::WaitInput:
+      if (!input) {
+        input = console_has_char();
+      }
+      if (*input) {
+        process->state = ProcessState::Ready;
+      }
+      break;
+    default:
+      break;
+    }
+    if (process->state == ProcessState::Ready) {
+      best = std::min<unsigned>(best, process->priority);
+    }
+  }
+
+  // Round robin among the highest priority processes that can run
+  for (size_t i = 0; i < processes.size(); i++) {
+    size_t index = (next + i) % processes.size();
+    Process &process = *processes[index];
+    if (process.state == ProcessState::Ready && process.priority == best) {
+      next = index + 1;
+      return &process;
+    }
+  }
+  return nullptr;
+}
+
+bool Scheduler::idle() {
+  // Nothing can run: sleep until a delay runs out or a key is pressed
+  std::optional<steady_clock::time_point> deadline;
+  bool input = false;
+  for (auto &process : processes) {
+    if (process->state == ProcessState::Delayed &&
+        (!deadline || process->wake_time < *deadline)) {
+      deadline = process->wake_time;
+    }
+    input = input || process->state == ProcessState::WaitInput;
+  }
+  if (!deadline && !input) {
+    std::cerr << "MP/M: all processes are waiting on each other" << std::endl;
+    return false;
+  }
+
+  timeval tv;
+  timeval *timeout = nullptr;
+  if (deadline) {
+    auto left = std::chrono::duration_cast<std::chrono::microseconds>(
+        *deadline - steady_clock::now());
+    int64_t us = std::max<int64_t>(left.count(), 0);
+    tv = {static_cast<time_t>(us / 1'000'000),
+          static_cast<suseconds_t>(us % 1'000'000)};
+    timeout = &tv;
+  }
+  fd_set set;
+  FD_ZERO(&set);
+  if (input) {
+    FD_SET(STDIN_FILENO, &set);
+  }
+  select(input ? STDIN_FILENO + 1 : 0, &set, nullptr, nullptr, timeout);
+  return true;
+}
+
+bool Scheduler::run() {
+  while (true) {
+    Process *process = pick();
+    if (!process) {
+      bool all_done = std::all_of(
+          processes.begin(), processes.end(), [](const auto &process) {
+            return process->state == ProcessState::Done;
+          });
+      if (all_done) {
+        return true;
+      }
+      if (!idle()) {
+        return false;
+      }
+      continue;
+    }
+
+    running = process;
+    Machine &machine = *process->machine;
+    uint64_t executed = z80_execute(&machine.cpu, quantum);
+    running = nullptr;
+    machine.cycles += executed;
+    total_cycles += executed;
+    governor.pace(total_cycles);
+  }
+}
@@ -0,0 +1,185 @@
+#include <algorithm>
+#include <array>
+#include <format>
+#include <iostream>
+#include <terminal.hpp>
+
+static constexpr char ESC = 0x1b;
+
+// Bytes that may need translating; anything else is copied in bulk
+static constexpr std::array<bool, 256> make_special(TerminalType type) {
+  std::array<bool, 256> special{};
+  special[ESC] = true;
+  if (type == TerminalType::Adm3a) {
+    special[0x0b] = true; // ^K: cursor up
+    special[0x0c] = true; // ^L: cursor right
+    special[0x1a] = true; // ^Z: clear screen
+    special[0x1e] = true; // ^^: home
+  }
+  return special;
+}
+
+static constexpr std::array<bool, 256> adm3a_special =
+    make_special(TerminalType::Adm3a);
+static constexpr std::array<bool, 256> vt52_special =
+    make_special(TerminalType::Vt52);
+
+void Terminal::write(std::string_view text) {
+  if (type == TerminalType::Ansi) {
+    out.append(text);
+    return;
+  }
+
+  const std::array<bool, 256> &special =
+      type == TerminalType::Adm3a ? adm3a_special : vt52_special;
+  const char *p = text.data();
+  const char *end = p + text.size();
+  while (p < end) {
+    if (state == State::Normal) {
+      const char *run = std::find_if(p, end, [&](char ch) {
+        return special[static_cast<unsigned char>(ch)];
+      });
+      out.append(p, run);
+      if (run == end) {
+        break;
+      }
+      p = run;
+      control(*p++);
+      continue;
+    }
+
+    char ch = *p++;
+    switch (state) {
+    case State::Escape:
+      escape(ch);
+      break;
+    case State::Row:
+      row = static_cast<uint8_t>(ch);
+      state = State::Column;
+      break;
+    case State::Column:
+      move_to(row, static_cast<uint8_t>(ch));
+      state = State::Normal;
+      break;
+    case State::Normal:
+      break;
+    }
+  }
+}
+
+void Terminal::flush() {
+  if (!out.empty()) {
+    std::cout.write(out.data(), static_cast<std::streamsize>(out.size()));
+    out.clear();
+  }
+  std::cout.flush();
+}
+
+void Terminal::control(char ch) {
+  switch (ch) {
+  case ESC:
+    state = State::Escape;
+    break;
+  case 0x0b:
+    out += "\x1b[A";
+    break;
+  case 0x0c:
+    out += "\x1b[C";
+    break;
+  case 0x1a:
+    out += "\x1b[H\x1b[2J";
+    break;
+  case 0x1e:
+    out += "\x1b[H";
+    break;
+  default:
+    out += ch;
+    break;
+  }
+}
+
+void Terminal::escape(char ch) {
+  state = State::Normal;
+
+  if (type == TerminalType::Adm3a) {
+    switch (ch) {
+    case '=': // ESC = row+32 col+32
+      state = State::Row;
+      return;
+    case 'T': // Clear to end of line
+      out += "\x1b[K";
+      return;
+    case 'Y': // Clear to end of screen
+      out += "\x1b[J";
+      return;
+    case 'E': // Insert line
+      out += "\x1b[L";
+      return;
+    case 'R': // Delete line
+      out += "\x1b[M";
+      return;
+    }
+  } else {
+    switch (ch) {
+    case 'A':
+    case 'B':
+    case 'C':
+    case 'D': // Cursor up/down/right/left
+      out += std::format("\x1b[{}", ch);
+      return;
+    case 'H': // Home
+      out += "\x1b[H";
+      return;
+    case 'E': // Clear screen (Z19/Atari)
+      out += "\x1b[H\x1b[2J";
+      return;
+    case 'I': // Reverse line feed
+      out += "\x1bM";
+      return;
+    case 'J': // Clear to end of screen
+      out += "\x1b[J";
+      return;
+    case 'K': // Clear to end of line
+      out += "\x1b[K";
+      return;
+    case 'L': // Insert line
+      out += "\x1b[L";
+      return;
+    case 'M': // Delete line
+      out += "\x1b[M";
+      return;
+    case 'Y': // ESC Y row+32 col+32
+      state = State::Row;
+      return;
+    case 'p': // Reverse video on
+      out += "\x1b[7m";
+      return;
+    case 'q': // Reverse video off
+      out += "\x1b[27m";
+      return;
+    case 'e': // Cursor on
+      out += "\x1b[?25h";
+      return;
+    case 'f': // Cursor off
+      out += "\x1b[?25l";
+      return;
+    case 'j': // Save cursor
+      out += "\x1b" "7";
+      return;
+    case 'k': // Restore cursor
+      out += "\x1b" "8";
+      return;
+    }
+  }
+
+  // Unknown sequence: pass it through as-is
+  out += ESC;
+  out += ch;
+}
+
+void Terminal::move_to(uint8_t row, uint8_t column) {
+  // Coordinates are offset by 32; ANSI counts from 1
+  int r = row >= 32 ? row - 31 : 1;
+  int c = column >= 32 ? column - 31 : 1;
+  out += std::format("\x1b[{};{}H", r, c);
+}